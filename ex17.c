@@ -15,6 +15,11 @@ documentation.
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MAX_DATA 512
 #define MAX_ROWS 100
@@ -44,22 +49,32 @@ struct Database {
 };
 
 struct Connection {
-    FILE *file;
+    int fd;
     struct Database *db;
+    char dirty[MAX_ROWS];
 
     /*
     Why pointer to db?
     I figure this is because the Database struct isn't "part of" the Connection
     struct the way Address structs are "part of" Database structs.  The
-    Database struct already exists in heap memory, and the Connection just
+    Database struct already exists in memory, and the Connection just
     needs to know where it is.  Hence the db pointer.
 
-    FILE defined in <stdio.h>
-    www.gnu.org on FILE:  This is the data type used to represent stream objects.
-    A FILE object holds all of the internal state information about the connection
-    to the associated file, including such things as the file position indicator
-    and buffering information. Each stream also has error and end-of-file status
-    indicators that can be tested with the ferror and feof functions
+    The original exercise used a FILE stream here and fread() the whole
+    Database into a malloc'd block on every run.  Now the connection holds a
+    plain file descriptor from open(2) and db points straight into a
+    memory-mapped view of the file (see Database_open), so there is no heap
+    copy of the database at all.
+
+    A file descriptor is just a small int the kernel hands back to identify
+    an open file.  Unlike a FILE object there is no user-space buffering or
+    position bookkeeping on top of it, which is fine here because we never
+    read() or write() the file directly - the kernel pages the data in and
+    out of the mapping for us.
+
+    dirty[] has one flag per row.  Database_set/Database_delete/Database_create
+    raise the flag for each row they change so that Database_write knows
+    exactly which rows have to go back to disk.
     */
 };
 
@@ -85,31 +100,47 @@ void Address_print(struct Address *addr)
     printf("%d %s %s\n", addr->id, addr->name, addr->email);
 }
 
-void Database_load(struct Connection *conn)
+void Database_load(struct Connection *conn, int prot)
 {
-    int rc = fread(conn->db, sizeof(struct Database), 1, conn->file);
-    if(rc != 1){
+    struct stat st;
+
+    int rc = fstat(conn->fd, &st);
+    if(rc == -1 || st.st_size != sizeof(struct Database)){
         die("Failed to load database.");
     }
 
-    /*
-    from man 3 fread:  The function fread(ptr, size, nitems, stream) reads
-    'nitems' objects, each 'size' bytes long, from the stream pointed to by
-    'stream', storing them at the location given by 'ptr'
-
-    So this fread() is reading 1 object that is the size of a database struct
-    from the stream pointed to by conn->file and storing that information at
-    the location pointed to by conn->db.  AKA it's pulling data from the
-    file into RAM and storing it at the location pointed to by conn->db.
-
-    fread() returns the number of objects that were read, hence the rc != 1 logic.
-    If an error occurs, the rc is a short object count or zero.
-
-    Zed wrote a bunch of {}-less if statements throughout this example, but he
-    said this is "very" bad form in ex12.  I've changed them because I agree
-    with Zed-from-ex12...
+    conn->db = mmap(NULL, sizeof(struct Database), prot, MAP_SHARED, conn->fd, 0);
+    if(conn->db == MAP_FAILED){
+        conn->db = NULL;
+        die("Failed to load database.");
+    }
 
-    if(rc != 1) die("Failed to load database."); <-- sample code from lazy-ex17-Zed
+    /*
+    This used to fread() the entire Database struct (MAX_ROWS * ~1KB) into a
+    malloc'd block every time the program ran, even for a single 'g'.  Now it
+    maps the file instead.
+
+    fstat() fills in a struct stat with information about the open file,
+    including st_size.  A file that isn't exactly one Database long was either
+    never created by this program or got cut off, which is the same case the
+    old short fread() caught, so it gets the same error.
+
+    from man 2 mmap:  mmap(addr, length, prot, flags, fd, offset) creates a
+    new mapping in the virtual address space of the calling process.  With
+    MAP_SHARED, updates to the mapping are visible to other processes mapping
+    the same region and are carried through to the underlying file.
+
+    So conn->db now points at the file's contents "as" a struct Database.
+    Nothing is actually read yet - the kernel faults in only the pages that
+    get touched, so a 'g' reads the one or two pages its Address lives on and
+    a 'l' walks the rest.  Writes through the pointer dirty just the pages
+    they touch, and only those pages go back to disk (see Database_write).
+
+    prot is PROT_READ for the read-only actions, which means a stray write
+    through conn->db would segfault instead of silently changing the file.
+
+    mmap returns MAP_FAILED (not NULL) on error, so db is reset to NULL to
+    keep Database_close from trying to munmap it.
     */
 }
 
@@ -120,23 +151,35 @@ struct Connection *Database_open(const char *filename, char mode)
         die("Memory error");
     }
 
-    conn->db = malloc(sizeof(struct Database));
-    if(!conn->db){
-        die("Memory error");
-    }
+    conn->db = NULL;
+    memset(conn->dirty, 0, sizeof(conn->dirty));
 
     if(mode == 'c'){
-        conn->file = fopen(filename, "w");
+        conn->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    } else if(mode == 'g' || mode == 'l'){
+        conn->fd = open(filename, O_RDONLY);
     } else {
-        conn->file = fopen(filename, "r+");
+        conn->fd = open(filename, O_RDWR);
+    }
+
+    if(conn->fd == -1){
+        die("Failed to open the file");
+    }
 
-        if(conn->file){
-            Database_load(conn);
+    if(flock(conn->fd, mode == 'g' || mode == 'l' ? LOCK_SH : LOCK_EX) == -1){
+        die("Failed to lock the file");
+    }
+
+    if(mode == 'c'){
+        if(ftruncate(conn->fd, 0) == -1 || ftruncate(conn->fd, sizeof(struct Database)) == -1){
+            die("Failed to size the file");
         }
     }
 
-    if(!conn->file){
-        die("Failed to open the file");
+    if(mode == 'g' || mode == 'l'){
+        Database_load(conn, PROT_READ);
+    } else {
+        Database_load(conn, PROT_READ | PROT_WRITE);
     }
 
     return conn;
@@ -148,89 +191,118 @@ struct Connection *Database_open(const char *filename, char mode)
     struct and returning a pointer to this memory block, stored in the variable conn,
     and then confirms that the pointer returned by malloc() is not a NULL pointer.
 
-    With Connection struct created in memory and the conn variable holding a pointer
-    to its location, the next step malloc's a block of heap memory to hold the
-    Database struct that will eventually be read in from a file.  The function
-    checks that the pointer returned by malloc() is not NULL.
-
-    If the program has been run in create mode ('c'), then fopen() will open the file
-    in 'w' mode.  Note that if bin/ex17 <filename> c is run on an existing file, that
-    file will be overwritten per the 'w' specification.  For any other option, the
-    file will be opened in 'r+' mode, which will allow both reading and writing but
-    will not truncate the file to zero length as with 'w'.
-
-    In either case, fopen() will return a FILE pointer if successful, or NULL if not.
-
-    In any mode but 'c/create', the function will also attempt to use Database_load
-    to load data from the database file into the heap memory location pointed to
-    by conn->db (malloc'd a few lines up).
-
-    In all modes, if the conn->file pointer has not been successfully set by fopen(),
-    the function will cause the program to die.
-
-    The function returns a pointer to the newly populated Connection struct.
+    Unlike the original exercise there is no malloc for the Database itself.
+    Database_load maps the file and points conn->db at the mapping, so the
+    "RAM version" of the database is really just the kernel's page cache.
+
+    If the program has been run in create mode ('c'), then open() is called with
+    O_CREAT, which creates the file if it isn't there.  Note that bin/ex17
+    <filename> c on an existing file still wipes it, but only once we hold the
+    lock (see below), so O_TRUNC can't be used: it would empty the file under
+    whoever is using it right now.  Instead ftruncate() cuts it to zero bytes and
+    then extends it to exactly sizeof(struct Database), since you can't map bytes
+    that don't exist.  The new bytes read back as zeros, which Database_create
+    then fills in.
+
+    The read-only actions (g/l) open with O_RDONLY and map with PROT_READ.
+    Everything else opens O_RDWR, which (like fopen's 'r+') allows reading and
+    writing without truncating.
+
+    open() returns a file descriptor (>= 0) if successful, or -1 if not, in which
+    case the program dies.
+
+    Two copies of the program can have the same file mapped at once, and with
+    MAP_SHARED they really are looking at the same pages, so a 'g' could print a
+    row that an 's' is halfway through copying in.  flock() puts an advisory
+    lock on the whole file: LOCK_SH for the read-only actions, which any number
+    of processes can hold together, and LOCK_EX for everything else, which
+    waits until nobody else holds any lock.  Without LOCK_NB it blocks rather
+    than failing, so writers simply take turns.  The lock belongs to the open
+    file description and goes away by itself when Database_close closes the fd
+    (or the process dies), so there is no unlock call.  "Advisory" means it only
+    keeps out other programs that also call flock(); nothing stops cat or a
+    text editor from touching the file.
+
+    So unlike ex17_mod, readers here don't run beside a writer: a 'g' or 'l'
+    waits for any 's', 'd' or 'c' holding LOCK_EX, and a writer waits for the
+    readers.  ex17_mod can let them overlap because its writer only appends
+    until a checkpoint, and the header's generation tells a reader when to start
+    over (Database_snapshot).  This file has no header, and rows change in place
+    in the shared mapping, so a reader has nothing to check a row against.  The
+    wait is short anyway: an 's' or 'd' holds the lock for one row's copy and
+    msync(), and only a 'c' holds it while the whole file is written.
     */
 }
 
 void Database_close(struct Connection *conn)
 {
     if(conn) {
-        if(conn->file){
-            fclose(conn->file);
-        }
         if(conn->db){
-            free(conn->db);
+            munmap(conn->db, sizeof(struct Database));
+        }
+        if(conn->fd != -1){
+            close(conn->fd);
         }
         free(conn);
     }
 
     /*
-    After ensuring that the conn pointer is not NULL, and that the associated
-    pointers to the FILE object and to the db heap memory are not NULL, this
-    function 'closes' the file, frees the heap memory that was set aside for
-    db, and finally frees the heap memory that was set aside for the conn.
-
-    fclose() dissociates the named stream (conn->file) from its underlying file
-    or set of functions after first writing any buffered data using fflush().
-    It's not used here, but fclose() returns a 0 if successful.  If unsuccessful,
-    it (presumably) returns -1 and sets the global errno variable.
+    After ensuring that the conn pointer is not NULL, this function unmaps the
+    database (if it was ever mapped), closes the file descriptor, and finally
+    frees the heap memory that was set aside for the conn.
+
+    munmap() deletes the mapping.  For a MAP_SHARED mapping any pages that were
+    modified are still written back to the file eventually even without msync(),
+    but Database_write does an explicit msync() so that the data is known to
+    have reached the file before we report success.
+
+    close() releases the file descriptor.  Closing it doesn't affect the mapping,
+    which is why the order of the two calls doesn't really matter here.
     */
 }
 
 void Database_write(struct Connection *conn)
 {
-    rewind(conn->file);
+    long page = sysconf(_SC_PAGESIZE);
+    int i = 0;
 
-    int rc = fwrite(conn->db, sizeof(struct Database), 1, conn->file);
-    if(rc != 1){
-        die("Failed to write database");
-    }
+    for(i = 0; i < MAX_ROWS; i++){
+        if(!conn->dirty[i]){
+            continue;
+        }
+
+        char *start = (char *)&conn->db->rows[i];
+        char *end = start + sizeof(struct Address);
+        char *first_page = (char *)conn->db + ((start - (char *)conn->db) / page) * page;
+
+        int rc = msync(first_page, end - first_page, MS_SYNC);
+        if(rc == -1){
+            die("Cannot flush database");
+        }
 
-    rc = fflush(conn->file);
-    if(rc == -1){
-        die("Cannot flush database");
+        conn->dirty[i] = 0;
     }
 
     /*
-    rewind() sets the file position indicator for the stream pointed to by
-    conn->file to the beginning of the file.  I'm guessing this is necessary
-    because some file positioning attribute within the FILE object has to be
-    reset as this file was potentially read in a Database_load operation.
+    The old version of this function rewound the FILE and fwrite()'d the whole
+    Database struct back out, so changing one row rewrote all MAX_ROWS of them.
 
-    fwrite(conn->db, db_size, 1, conn->file) writes 1 object of size db_size
-    to the stream pointed to by conn->file, obtaining the data from the
-    location given by conn->db.
+    With the file mapped, Database_set/Database_delete/Database_create have
+    already made their changes directly in the mapping.  All that's left is to
+    make sure those changes actually reach the file.
 
-    fwrite() returns the number of objects written, so in this case an
-    rc == 1 indicates success.
+    from man 2 msync:  msync() flushes changes made to the in-core copy of a
+    file that was mapped into memory using mmap() back to the filesystem.
+    MS_SYNC requests an update and waits for it to complete.
 
-    From what I can tell, it seems like fwrite() is only sending data to the
-    stream, so it will be buffered/actually written per the FILE object.
-    So to be sure all of the data went all the way through to the file
-    itself...
+    Rather than msync'ing the whole mapping, this only syncs the byte range of
+    each row flagged in conn->dirty, which is the mmap version of pwrite()'ing
+    one row at its offset (&rows[i] is that offset inside the mapping).  msync
+    insists on a page-aligned start address, so the start is rounded down to
+    the page the row begins on; a 1032-byte row spans at most two 4KB pages.
+    So a 's' or 'd' writes back one or two pages no matter how big MAX_ROWS
+    gets, and a 'c' (which marks every row dirty) writes the whole file.
 
-    fflush(ptr_to_stream) forces a write of all buffered data for the given
-    output or update stream via the stream's underlying write function.
     rc == 0 if successful, otherwise rc == -1 and errno is set.
     */
 }
@@ -243,6 +315,7 @@ void Database_create(struct Connection *conn)
         // make a prototype to initialize it and then just assign it
         struct Address addr = {.id = i, .set = 0};
         conn->db->rows[i] = addr;
+        conn->dirty[i] = 1;
     }
 
     /*
@@ -277,6 +350,7 @@ void Database_set(struct Connection *conn, int id, const char *name, const char
     }
 
     addr->set = 1;
+    conn->dirty[id] = 1;
 
     char *res = strncpy(addr->name, name, MAX_DATA - 1);
     addr->name[MAX_DATA - 1] = '\0';
@@ -351,6 +425,7 @@ void Database_delete(struct Connection *conn, int id)
 {
     struct Address addr = {.id = id, .set = 0};
     conn->db->rows[id] = addr;
+    conn->dirty[id] = 1;
 
     /*
     This function is the first step in a 1-2 move to delete a row from
@@ -358,7 +433,8 @@ void Database_delete(struct Connection *conn, int id)
     updates the corresponding 'row' entry in the RAM db by assigning an
     empty prototype to the location corresponding to the given id.  The
     next step, handled by the Database_write function, is to push these
-    RAM changes to the db file.
+    RAM changes to the db file.  Flagging the row in conn->dirty is what
+    tells Database_write that this row (and only this row) needs pushing.
     */
 }
 
@@ -464,10 +540,9 @@ int main(int argc, char *argv[])
     open a database connection by running the Database_open function, which will
     return a pointer to a struct Connection stored in the variable conn.  Note
     that at this point the action could be invalid, but the connection will
-    still be opened in 'r+' mode.  Database_open is tasked with establishing
-    a stream to the designated file (conn->file) and malloc'ing appropriate
-    heap memory blocks for the conn object and the RAM representation of the
-    db file.
+    still be opened read/write.  Database_open is tasked with opening the
+    designated file (conn->fd), malloc'ing the conn object, and mapping the
+    db file into memory (conn->db).
 
     It is assumed that argv[3], if present, will always represent the id of a
     row to be operated on.  If there are more than 3 args, then argv[3] is
@@ -487,16 +562,16 @@ int main(int argc, char *argv[])
 
     If a bad action is given, the program is killed via die() as the default case.
 
-    Finally, Database_close executes cleanup operations by ensuring the file
-    stream is properly closed, then freeing the heap memory malloc'd for the
-    RAM db, then freeing the heap memory malloc'd for the conn struct.
+    Finally, Database_close executes cleanup operations by unmapping the db,
+    closing the file descriptor, then freeing the heap memory malloc'd for the
+    conn struct.
 
     If all of this executes without triggering a die() call, then the program
     exits with status code 0 indicating success.
 
     Also note that Database_open is designed to do all of the requisite malloc'ing
-    for the program, and that Database_close is designed to safely clean up
-    all of the malloc'd memory and the open files from Database_open.
+    and mapping for the program, and that Database_close is designed to safely
+    clean up all of the malloc'd memory, mappings and open files from Database_open.
     */
 }
 
@@ -0,0 +1,473 @@
+/*
+Benchmark for the address databases in ex17.c and ex17_mod.c.
+
+Each program is run the way it is meant to be used, one process per
+action, against a synthetic database in a scratch directory.  The
+database is filled to a given ratio of its rows with generated names
+and emails, then every action is run many times and timed from fork()
+to exit.  For each action it prints the median and 99th percentile
+latency, the throughput, and the bytes the process read and wrote.
+
+Usage: ex17_bench [rows [fill% [runs [program...]]]]
+
+rows and fill% size the database (ex17 always has its fixed 100 rows),
+runs is how many times each single row action is timed (the actions
+that touch the whole file run a tenth as often), and the programs
+default to the optimized builds 'make bench' puts in bin/.  A program
+whose name contains "ex17_mod" gets the ex17_mod actions, anything else
+is driven like ex17.
+
+open+load is ex17_mod's t, which loads every row and prints a few
+lines about them.  ex17 has no action that only opens its file (every
+one of them is a whole get, set or list), so it has no open+load row.
+
+Bytes read and written come from /proc/<pid>/io, so they are only
+counted on Linux and only for read()/write() calls: ex17 mmap()s its
+file and shows almost nothing.  Every exec also reads the program's
+libraries, so the bytes of a run with no arguments, which only prints
+the usage, are measured first and taken off each action's.  Bytes
+written leave out what the action printed, which goes to a scratch file
+rather than the terminal.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_ROWS 100000
+#define BENCH_FILL 50
+#define BENCH_RUNS 200
+#define BENCH_MAX_DATA 512
+#define BENCH_EX17_ROWS 100     // MAX_ROWS in ex17.c
+#define BENCH_MAX_ARGS 8
+
+enum { OP_CREATE, OP_OPEN, OP_GET, OP_SET, OP_DELETE, OP_LIST, OP_FIND,
+    OP_RESIZE, OP_COUNT };
+
+const char *Op_names[OP_COUNT] = {
+    "create", "open+load", "get", "set", "delete", "list", "find", "resize"
+};
+
+struct Op {
+    int runs;
+    double *ms;         // latency of each run
+    long read;          // bytes over all runs, -1 if they can't be counted
+    long written;
+};
+
+struct Bench {
+    const char *prog;
+    int mod;            // driven as ex17_mod, otherwise as ex17
+    int rows;
+    int fill;
+    int runs;
+    char dir[64];
+    char db[96];
+    char wal[96];
+    char created[96];
+    char out[96];
+    char csv[96];
+    int *ids;           // the ids that are set
+    int count;
+    long base_read;     // what a run that does nothing reads and writes
+    long base_written;
+    struct Op ops[OP_COUNT];
+};
+
+void die(const char *message)
+{
+    if(errno){
+        perror(message);
+    } else {
+        printf("ERROR: %s\n", message);
+    }
+
+    exit(1);
+}
+
+double Bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int Bench_io(pid_t pid, long *read, long *written)
+// rchar/wchar of a child that has exited but not been reaped yet
+{
+    char path[64];
+    char line[128];
+    long value = 0;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *file = fopen(path, "r");
+    if(!file){
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), file)){
+        if(sscanf(line, "rchar: %ld", &value) == 1){
+            *read = value;
+            found++;
+        } else if(sscanf(line, "wchar: %ld", &value) == 1){
+            *written = value;
+            found++;
+        }
+    }
+
+    fclose(file);
+    return found == 2;
+}
+
+int Bench_spawn(struct Bench *b, char *args[], double *ms, long *read, long *written)
+// run prog with args once, timing it and counting its io (what it
+// printed left out), and hand back its exit status; -1 in read if
+// the io can't be counted
+{
+    siginfo_t info;
+    struct stat st;
+    int status = 0;
+
+    int out = open(b->out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out == -1){
+        die("Failed to open the output file");
+    }
+
+    double start = Bench_now();
+    pid_t pid = fork();
+    if(pid == -1){
+        die("Failed to fork");
+    }
+    if(pid == 0){
+        dup2(out, STDOUT_FILENO);
+        execv(b->prog, args);
+        perror(b->prog);
+        _exit(127);
+    }
+
+    // WNOWAIT leaves the child around so its io counters can be read
+    if(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1){
+        die("Failed to wait for the child");
+    }
+    *ms = Bench_now() - start;
+    int counted = Bench_io(pid, read, written);
+    waitpid(pid, &status, 0);
+
+    fstat(out, &st);
+    close(out);
+
+    if(!counted){
+        *read = -1;
+    }
+    *written -= st.st_size;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void Bench_baseline(struct Bench *b)
+{
+    // the fewest bytes any of a few runs without arguments moved
+    char *args[] = { (char *)b->prog, NULL };
+    long read = 0;
+    long written = 0;
+    double ms = 0;
+
+    for(int i = 0; i < 3; i++){
+        Bench_spawn(b, args, &ms, &read, &written);
+        if(i == 0 || read < b->base_read){
+            b->base_read = read;
+        }
+        if(i == 0 || written < b->base_written){
+            b->base_written = written;
+        }
+    }
+}
+
+void Bench_run(struct Bench *b, int op, char *args[])
+// run prog with args once and add it to op's numbers
+{
+    struct Op *o = &b->ops[op];
+    long read = 0;
+    long written = 0;
+    double ms = 0;
+
+    int status = Bench_spawn(b, args, &ms, &read, &written);
+    if(status != 0){
+        fprintf(stderr, "%s failed:", b->prog);
+        for(int i = 1; args[i]; i++){
+            fprintf(stderr, " %s", args[i]);
+        }
+        fprintf(stderr, "\n");
+        errno = 0;
+        die("Benchmark action failed");
+    }
+
+    o->ms[o->runs++] = ms;
+    if(read < 0 || b->base_read < 0 || o->read < 0){
+        o->read = -1;
+    } else {
+        o->read += read > b->base_read ? read - b->base_read : 0;
+        o->written += written > b->base_written ? written - b->base_written : 0;
+    }
+}
+
+void Bench_action(struct Bench *b, int op, const char *db, const char *action, ...)
+// run "prog db action args..." with the args (NULL ended) given as strings
+{
+    char *args[BENCH_MAX_ARGS] = { (char *)b->prog, (char *)db, (char *)action };
+    int argc = 3;
+    va_list ap;
+
+    va_start(ap, action);
+    while(argc < BENCH_MAX_ARGS - 1 && (args[argc] = va_arg(ap, char *))){
+        argc++;
+    }
+    va_end(ap);
+    args[argc] = NULL;
+
+    Bench_run(b, op, args);
+}
+
+void Bench_fill(struct Bench *b)
+// create the database and set about fill% of its rows
+{
+    char rows[16];
+    char data[16];
+    char id[16];
+    char name[32];
+    char email[48];
+    int i = 0;
+
+    b->ids = malloc(b->rows * sizeof(int));
+    if(!b->ids){
+        die("Memory error");
+    }
+    for(i = 0; i < b->rows; i++){
+        if(rand() % 100 < b->fill){
+            b->ids[b->count++] = i;
+        }
+    }
+
+    snprintf(rows, sizeof(rows), "%d", b->rows);
+    snprintf(data, sizeof(data), "%d", BENCH_MAX_DATA);
+
+    if(!b->mod){
+        Bench_action(b, OP_CREATE, b->db, "c", NULL);
+        for(i = 0; i < b->count; i++){
+            snprintf(id, sizeof(id), "%d", b->ids[i]);
+            snprintf(name, sizeof(name), "name%d", b->ids[i]);
+            snprintf(email, sizeof(email), "user%d@example.com", b->ids[i]);
+            Bench_action(b, OP_SET, b->db, "s", id, name, email, NULL);
+        }
+        return;
+    }
+
+    // ex17_mod imports the rows in one go
+    FILE *csv = fopen(b->csv, "w");
+    if(!csv){
+        die("Failed to open the import file");
+    }
+    for(i = 0; i < b->count; i++){
+        fprintf(csv, "%d,name%d,user%d@example.com\n", b->ids[i], b->ids[i], b->ids[i]);
+    }
+    if(fclose(csv) != 0){
+        die("Failed to write the import file");
+    }
+
+    Bench_action(b, OP_CREATE, b->db, "c", data, rows, NULL);
+    Bench_action(b, OP_SET, b->db, "i", b->csv, NULL);
+}
+
+void Bench_reset(struct Bench *b)
+{
+    for(int op = 0; op < OP_COUNT; op++){
+        b->ops[op].runs = 0;
+        b->ops[op].read = 0;
+        b->ops[op].written = 0;
+    }
+}
+
+void Bench_actions(struct Bench *b)
+{
+    int whole = b->runs / 10 > 3 ? b->runs / 10 : 3;
+    char rows[16];
+    char data[16];
+    char id[16];
+    char name[32];
+    char email[48];
+    int i = 0;
+
+    snprintf(rows, sizeof(rows), "%d", b->rows);
+
+    for(i = 0; i < whole; i++){
+        unlink(b->created);
+        if(b->mod){
+            snprintf(data, sizeof(data), "%d", BENCH_MAX_DATA);
+            Bench_action(b, OP_CREATE, b->created, "c", data, rows, NULL);
+        } else {
+            Bench_action(b, OP_CREATE, b->created, "c", NULL);
+        }
+    }
+
+    if(b->count == 0){
+        return;
+    }
+
+    for(i = 0; i < b->runs; i++){
+        int row = b->ids[rand() % b->count];
+
+        snprintf(id, sizeof(id), "%d", row);
+        snprintf(name, sizeof(name), "name%d", row);
+        snprintf(email, sizeof(email), "user%d@example.com", row);
+
+        if(b->mod){
+            Bench_action(b, OP_OPEN, b->db, "t", NULL);
+        }
+        Bench_action(b, OP_GET, b->db, "g", id, NULL);
+        // a set needs the row free, so delete it and set it back
+        Bench_action(b, OP_DELETE, b->db, "d", id, NULL);
+        Bench_action(b, OP_SET, b->db, "s", id, name, email, NULL);
+    }
+
+    for(i = 0; i < whole; i++){
+        int row = b->ids[rand() % b->count];
+
+        Bench_action(b, OP_LIST, b->db, "l", NULL);
+        if(b->mod){
+            snprintf(name, sizeof(name), "name%d", row);
+            Bench_action(b, OP_FIND, b->db, "f", name, NULL);
+            // every resize rewrites the file, flip max_data so each changes it
+            snprintf(data, sizeof(data), "%d", BENCH_MAX_DATA - i % 2);
+            Bench_action(b, OP_RESIZE, b->db, "r", data, rows, NULL);
+        }
+    }
+}
+
+int Bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+void Bench_report(struct Bench *b)
+{
+    printf("\n%s: %d rows, %d set, %d runs\n", b->prog, b->rows, b->count, b->runs);
+    printf("%-10s %6s %10s %10s %10s %12s %12s\n", "action", "runs",
+            "p50 ms", "p99 ms", "ops/s", "read/op", "written/op");
+
+    for(int op = 0; op < OP_COUNT; op++){
+        struct Op *o = &b->ops[op];
+        double total = 0;
+
+        if(o->runs == 0){
+            printf("%-10s %6s\n", Op_names[op], "-");
+            continue;
+        }
+
+        qsort(o->ms, o->runs, sizeof(double), Bench_compare);
+        for(int i = 0; i < o->runs; i++){
+            total += o->ms[i];
+        }
+
+        printf("%-10s %6d %10.3f %10.3f %10.1f", Op_names[op], o->runs,
+                o->ms[(o->runs - 1) / 2], o->ms[(o->runs - 1) * 99 / 100],
+                total > 0 ? o->runs * 1000.0 / total : 0);
+        if(o->read < 0){
+            printf(" %12s %12s\n", "-", "-");
+        } else {
+            printf(" %12ld %12ld\n", o->read / o->runs, o->written / o->runs);
+        }
+    }
+}
+
+void Bench_clean(struct Bench *b)
+{
+    char path[128];
+    const char *files[] = { b->db, b->wal, b->created, b->out, b->csv };
+
+    for(int i = 0; i < 5; i++){
+        unlink(files[i]);
+    }
+    snprintf(path, sizeof(path), "%s.wal", b->created);
+    unlink(path);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *defaults[] = { "bin/ex17_opt", "bin/ex17_mod_opt" };
+    const char **progs = defaults;
+    int nprogs = 2;
+    struct Bench b = { .rows = BENCH_ROWS, .fill = BENCH_FILL, .runs = BENCH_RUNS };
+    const char *tmp = getenv("TMPDIR");
+
+    if(argc > 1){
+        b.rows = atoi(argv[1]);
+    }
+    if(argc > 2){
+        b.fill = atoi(argv[2]);
+    }
+    if(argc > 3){
+        b.runs = atoi(argv[3]);
+    }
+    if(argc > 4){
+        progs = (const char **)argv + 4;
+        nprogs = argc - 4;
+    }
+    if(b.rows < 1 || b.fill < 0 || b.fill > 100 || b.runs < 1){
+        die("USAGE: ex17_bench [rows [fill% [runs [program...]]]]");
+    }
+    int rows = b.rows;
+
+    snprintf(b.dir, sizeof(b.dir), "%s/ex17_bench.XXXXXX", tmp ? tmp : "/tmp");
+    if(!mkdtemp(b.dir)){
+        die("Failed to make a scratch directory");
+    }
+    snprintf(b.db, sizeof(b.db), "%s/bench.db", b.dir);
+    snprintf(b.wal, sizeof(b.wal), "%s/bench.db.wal", b.dir);
+    snprintf(b.created, sizeof(b.created), "%s/created.db", b.dir);
+    snprintf(b.out, sizeof(b.out), "%s/out", b.dir);
+    snprintf(b.csv, sizeof(b.csv), "%s/rows.csv", b.dir);
+
+    for(int p = 0; p < nprogs; p++){
+        // the same ids and actions for every program
+        srand(17);
+        b.prog = progs[p];
+        b.mod = strstr(b.prog, "ex17_mod") != NULL;
+        b.rows = b.mod ? rows : BENCH_EX17_ROWS;
+        b.count = 0;
+
+        for(int op = 0; op < OP_COUNT; op++){
+            b.ops[op].ms = malloc((b.runs + b.rows) * sizeof(double));
+            if(!b.ops[op].ms){
+                die("Memory error");
+            }
+        }
+
+        Bench_baseline(&b);
+        Bench_fill(&b);
+        Bench_reset(&b);
+        Bench_actions(&b);
+        Bench_report(&b);
+        Bench_clean(&b);
+
+        for(int op = 0; op < OP_COUNT; op++){
+            free(b.ops[op].ms);
+        }
+        free(b.ids);
+    }
+
+    rmdir(b.dir);
+
+    return 0;
+}
@@ -0,0 +1,364 @@
+/*
+Crash test for the checkpoints in ex17_mod.c.
+
+A checkpoint rewrites bitmap, table and hash index pages in place, and
+the header last.  It puts all of those writes in the log first (see
+Wal_log_staged), so a crash part way through them can always be
+finished from the log alone.  This kills an import's checkpoint at
+each of its page writes in turn, leaving that page half written, and
+checks that the next writer puts the file right both from the log as
+it was left and from a log emptied of everything but the page writes.
+Either way every row, the list, the stats and exact lookups through
+the hash index have to come out as if the import had never crashed.
+
+Usage: ex17_crash [program [rows]]
+
+The program defaults to bin/ex17_mod_tear, which 'make test' builds
+with EX17_TEAR: EX17_TEAR=n makes it write half of its nth page and
+exit with status 3.  rows sizes the database.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define CRASH_ROWS 3000
+#define CRASH_MAX_DATA 64
+#define CRASH_TORN 3        // the status EX17_TEAR exits with
+#define CRASH_KEYS 8        // rows looked up through the hash index each check
+
+struct Crash {
+    const char *prog;
+    int rows;
+    char dir[64];
+    char base[96];      // the database before the import
+    char db[96];        // a copy the import is torn in
+    char fixed[96];     // a copy of that a writer recovers
+    char out[96];
+    char csv[96];
+    char path[128];     // scratch for <db>.wal names
+    int failures;
+};
+
+void die(const char *message)
+{
+    if(errno){
+        perror(message);
+    } else {
+        printf("ERROR: %s\n", message);
+    }
+
+    exit(1);
+}
+
+int Crash_run(struct Crash *c, const char *tear, char *args[])
+// run prog with args, stdout into c->out and nothing on stdin, and
+// hand back its exit status
+{
+    int status = 0;
+
+    pid_t pid = fork();
+    if(pid == -1){
+        die("Failed to fork");
+    }
+    if(pid == 0){
+        int out = open(c->out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int in = open("/dev/null", O_RDONLY);
+        if(out == -1 || in == -1){
+            _exit(127);
+        }
+        dup2(out, STDOUT_FILENO);
+        dup2(in, STDIN_FILENO);
+        if(tear){
+            setenv("EX17_TEAR", tear, 1);
+        }
+        execv(c->prog, args);
+        perror(c->prog);
+        _exit(127);
+    }
+
+    if(waitpid(pid, &status, 0) == -1){
+        die("Failed to wait for the child");
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void Crash_action(struct Crash *c, const char *db, const char *action, const char *arg, const char *arg2)
+// "prog db action [arg [arg2]]", which has to succeed
+{
+    char *args[] = { (char *)c->prog, (char *)db, (char *)action, (char *)arg, (char *)arg2, NULL };
+
+    if(Crash_run(c, NULL, args) != 0){
+        fprintf(stderr, "%s %s %s %s %s failed\n", c->prog, db, action, arg ? arg : "", arg2 ? arg2 : "");
+        errno = 0;
+        die("Setting up the test failed");
+    }
+}
+
+char *Crash_slurp(const char *path, long *size)
+{
+    // the whole file, NUL ended
+    FILE *file = fopen(path, "r");
+    if(!file){
+        die("Failed to open a file to read");
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char *data = malloc(*size + 1);
+    if(!data || (long)fread(data, 1, *size, file) != *size){
+        die("Failed to read a file");
+    }
+    data[*size] = '\0';
+    fclose(file);
+
+    return data;
+}
+
+void Crash_copy(const char *from, const char *to)
+{
+    // an empty file for one that isn't there, as for a checkpointed log
+    long size = 0;
+    char *data = access(from, F_OK) == 0 ? Crash_slurp(from, &size) : NULL;
+    FILE *file = fopen(to, "w");
+
+    if(!file || (size && (long)fwrite(data, 1, size, file) != size) || fclose(file) != 0){
+        die("Failed to copy a file");
+    }
+    free(data);
+}
+
+void Crash_copy_db(struct Crash *c, const char *from, const char *to)
+{
+    char wal[128];
+
+    Crash_copy(from, to);
+    snprintf(c->path, sizeof(c->path), "%s.wal", from);
+    snprintf(wal, sizeof(wal), "%s.wal", to);
+    Crash_copy(c->path, wal);
+}
+
+void Crash_pages_only(struct Crash *c, const char *db)
+// drop every record from db's log but the p and P ones, the page
+// writes a checkpoint logged before starting on them
+{
+    int head[4];    // op, id, name_len, email_len, as in ex17_mod.c
+    long size = 0;
+    long pos = 0;
+    long kept = 0;
+
+    snprintf(c->path, sizeof(c->path), "%s.wal", db);
+    char *log = Crash_slurp(c->path, &size);
+
+    while(pos + (long)sizeof(head) <= size){
+        memcpy(head, log + pos, sizeof(head));
+        long len = sizeof(head) + (long)head[2] + head[3] + sizeof(uint32_t);
+        if(pos + len > size){
+            break;
+        }
+        if(head[0] == 'p' || head[0] == 'P'){
+            memmove(log + kept, log + pos, len);
+            kept += len;
+        }
+        pos += len;
+    }
+
+    FILE *file = fopen(c->path, "w");
+    if(!file || (kept && (long)fwrite(log, 1, kept, file) != kept) || fclose(file) != 0){
+        die("Failed to rewrite the log");
+    }
+    free(log);
+}
+
+char *Crash_state(struct Crash *c, const char *db, long *size)
+// everything the checks compare: the list, then exact lookups of the
+// first rows' emails and names, old and new.  The stats have to work
+// (they read every page) but their numbers may differ.  NULL if any
+// of it fails.
+{
+    char *args[] = { (char *)c->prog, (char *)db, "t", NULL, NULL, NULL };
+    char key[64];
+    long len = 0;
+    int i = 0;
+
+    if(Crash_run(c, NULL, args) != 0){
+        return NULL;
+    }
+    args[2] = "l";
+    if(Crash_run(c, NULL, args) != 0){
+        return NULL;
+    }
+    char *state = Crash_slurp(c->out, size);
+
+    for(i = 0; i < 4 * CRASH_KEYS; i++){
+        // user<i>, then the new ones, then the same for the names
+        snprintf(key, sizeof(key), i / CRASH_KEYS % 2 ? "%s%d_new%s" : "%s%d%s",
+                i < 2 * CRASH_KEYS ? "user" : "name", i % CRASH_KEYS * 3,
+                i < 2 * CRASH_KEYS ? "@example.com" : "");
+        args[2] = "e";
+        args[3] = key;
+        args[4] = i < 2 * CRASH_KEYS ? "email" : "name";
+        if(Crash_run(c, NULL, args) != 0){
+            free(state);
+            return NULL;
+        }
+
+        char *found = Crash_slurp(c->out, &len);
+        state = realloc(state, *size + len + 1);
+        if(!state){
+            die("Memory error");
+        }
+        memcpy(state + *size, found, len + 1);
+        *size += len;
+        free(found);
+    }
+
+    return state;
+}
+
+void Crash_check(struct Crash *c, const char *how, int tear, const char *want, long want_size)
+{
+    // a writer with nothing to do recovers c->fixed, then it has to match
+    char *args[] = { (char *)c->prog, c->fixed, "b", NULL };
+    long size = 0;
+    char *state = NULL;
+
+    if(Crash_run(c, NULL, args) == 0){
+        state = Crash_state(c, c->fixed, &size);
+    }
+    if(!state || size != want_size || memcmp(state, want, size) != 0){
+        printf("FAIL: torn at page write %d, recovered from %s\n", tear, how);
+        c->failures++;
+    }
+    free(state);
+}
+
+void Crash_scenario(struct Crash *c, const char *name, int first, int count)
+// import rows first to first + count - 1, each changed from the base
+// (or new), tearing the import's checkpoint at every page it writes
+{
+    char tear[16];
+    long want_size = 0;
+    int n = 0;
+    int i = 0;
+
+    FILE *csv = fopen(c->csv, "w");
+    if(!csv){
+        die("Failed to open the import file");
+    }
+    for(i = first; i < first + count; i++){
+        fprintf(csv, "%d,name%d_new,user%d_new@example.com\n", i, i, i);
+    }
+    if(fclose(csv) != 0){
+        die("Failed to write the import file");
+    }
+
+    // what it has to come out as
+    Crash_copy_db(c, c->base, c->db);
+    Crash_action(c, c->db, "i", c->csv, NULL);
+    char *want = Crash_state(c, c->db, &want_size);
+    if(!want){
+        die("The import didn't leave a good database");
+    }
+
+    for(n = 1; ; n++){
+        char *args[] = { (char *)c->prog, c->db, "i", c->csv, NULL };
+
+        Crash_copy_db(c, c->base, c->db);
+        snprintf(tear, sizeof(tear), "%d", n);
+        int status = Crash_run(c, tear, args);
+        if(status == 0){
+            break;
+        }
+        if(status != CRASH_TORN){
+            printf("FAIL: %s failed at page write %d with status %d\n", name, n, status);
+            c->failures++;
+            break;
+        }
+
+        Crash_copy_db(c, c->db, c->fixed);
+        Crash_check(c, "the log", n, want, want_size);
+
+        Crash_copy_db(c, c->db, c->fixed);
+        Crash_pages_only(c, c->fixed);
+        Crash_check(c, "page writes alone", n, want, want_size);
+    }
+
+    printf("%s: torn at each of %d page writes\n", name, n - 1);
+    free(want);
+}
+
+int main(int argc, char *argv[])
+{
+    struct Crash c = { .prog = "bin/ex17_mod_tear", .rows = CRASH_ROWS };
+    const char *tmp = getenv("TMPDIR");
+    char data[16];
+    char rows[16];
+    int i = 0;
+
+    if(argc > 1){
+        c.prog = argv[1];
+    }
+    if(argc > 2){
+        c.rows = atoi(argv[2]);
+    }
+    if(argc > 3 || c.rows < 4 * CRASH_KEYS){
+        die("USAGE: ex17_crash [program [rows]]");
+    }
+
+    snprintf(c.dir, sizeof(c.dir), "%s/ex17_crash.XXXXXX", tmp ? tmp : "/tmp");
+    if(!mkdtemp(c.dir)){
+        die("Failed to make a scratch directory");
+    }
+    snprintf(c.base, sizeof(c.base), "%s/base.db", c.dir);
+    snprintf(c.db, sizeof(c.db), "%s/torn.db", c.dir);
+    snprintf(c.fixed, sizeof(c.fixed), "%s/fixed.db", c.dir);
+    snprintf(c.out, sizeof(c.out), "%s/out", c.dir);
+    snprintf(c.csv, sizeof(c.csv), "%s/rows.csv", c.dir);
+
+    // every third row set, indexed by both keys
+    FILE *csv = fopen(c.csv, "w");
+    if(!csv){
+        die("Failed to open the import file");
+    }
+    for(i = 0; i < c.rows; i += 3){
+        fprintf(csv, "%d,name%d,user%d@example.com\n", i, i, i);
+    }
+    if(fclose(csv) != 0){
+        die("Failed to write the import file");
+    }
+    snprintf(data, sizeof(data), "%d", CRASH_MAX_DATA);
+    snprintf(rows, sizeof(rows), "%d", c.rows);
+    Crash_action(&c, c.base, "c", data, rows);
+    Crash_action(&c, c.base, "i", c.csv, NULL);
+    Crash_action(&c, c.base, "h", "both", NULL);
+
+    // patching the table where it is, then outgrowing it
+    Crash_scenario(&c, "in place", 0, c.rows / 2);
+    Crash_scenario(&c, "grown", c.rows / 2, c.rows);
+
+    const char *files[] = { c.base, c.db, c.fixed };
+    for(i = 0; i < 3; i++){
+        unlink(files[i]);
+        snprintf(c.path, sizeof(c.path), "%s.wal", files[i]);
+        unlink(c.path);
+    }
+    unlink(c.out);
+    unlink(c.csv);
+    rmdir(c.dir);
+
+    if(c.failures){
+        printf("%d failures\n", c.failures);
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}
@@ -33,323 +33,5079 @@ Modifications made to code in ex17.c:
     against either name or email strings of set records.  It can only
     match from the beginning of the strings, and returns a match if
     the first 3 characters match.
-
+5 - Database_write only writes back rows that changed.  Database_set and
+    Database_delete mark their row dirty, and Database_write_dirty
+    appends a new record for each dirty set row and points its table
+    entry at it (0 for a deleted row), as laid out in 7.  Rows that
+    didn't change are never touched, and nothing after a changed row
+    moves.  Only create, 'r' and upgrading an older file rewrite
+    everything (Database_rewrite, see 19).
+6 - Added a write-ahead log in <dbfile>.wal.  's' and 'd' no longer touch
+    the database file: they append a small record (op, id, name, email and
+    a CRC32) to the log instead, and Database_load replays the log on top
+    of the rows it read.  Records are buffered and only written+fsync'd by
+    Wal_commit, so every mutation in one run shares a single flush (group
+    commit), and the buffer is also flushed early if it passes
+    WAL_GROUP_BYTES.  Once the log grows past WAL_CHECKPOINT_BYTES,
+    Database_checkpoint folds it into the database with Database_write
+    (dirty rows only), fsyncs, and empties the log.  Replay just sets or
+    clears rows, so replaying a log that was already folded in (crash
+    between the write and the truncate) is harmless, and a torn record at
+    the end of the log fails its CRC and is dropped.  Each Wal_commit ends
+    its records with a C record, and replay only applies records that a C
+    follows (they are S and D now), so a commit cut short anywhere, even
+    in the middle of an import's one big write, counts for nothing.  Logs
+    written before that hold s and d records, which stand on their own.
+7 - New file format (version 2) with a row offset table.  The file starts
+    with a Header (DB_MAGIC, version, max_data, max_rows, garbage bytes),
+    followed by one int64 per row holding the file offset of that row's
+    record, or 0 if the row isn't set.  Records (id, name, email) follow
+    the table.  Row N's table entry is at a fixed offset, so 'g' reads
+    the header, one entry and one record (Database_row/Database_fetch_row)
+    instead of loading the whole file.  Database_write appends the records
+    of dirty set rows to the end of the file and only updates their table
+    entries; records left behind by a delete or re-set are counted in
+    garbage and dropped whenever the whole file is rewritten.  Old files
+    (no magic) are still read sequentially and get upgraded to version 2
+    the next time they are written.
+8 - Rows are only read from the file when something needs them.  main()
+    no longer calls Database_load up front; Database_get and Database_set
+    go through Database_row, which reads one row on demand, and
+    Database_delete/Database_apply use Database_row_unread because they
+    overwrite the row without looking at it.  Only Database_list and
+    Database_find, which really do need every row, load the rest of
+    the table.  A point operation on a big file allocates and reads one
+    row (plus whatever the log touched).
+9 - Names and emails come out of a per-Database arena instead of two
+    mallocs per row.  Arena_alloc hands out pieces of ARENA_BLOCK_SIZE
+    blocks one after the other, so rows loaded together sit next to each
+    other in memory, and Database_close frees the handful of blocks with
+    Arena_destroy instead of walking every row.  Nothing is freed one row
+    at a time any more; a deleted row's strings just stay in the arena
+    until close.
+10 - File format version 3 stores strings length-prefixed.  A record is
+    the id, name length and email length followed by just the string
+    bytes, so a 10 character name takes 10 bytes on disk instead of
+    max_data.  In RAM each string gets exactly strlen + 1 bytes from the
+    arena.  max_data is now only the longest string a row may hold
+    (anything longer is truncated to max_data - 1 characters), so growing
+    it with 'r' costs nothing.  Version 2 files (fixed width records) are
+    still read and get upgraded on their next write.
+11 - Implemented 'b' option for batches.  ex17 <dbfile> b [script] reads
+    one g/s/d/l/f command per line (same arguments as on the command
+    line, '#' starts a comment) from the script or stdin and runs them all
+    against one Connection through Database_execute.  Everything is
+    committed with one Wal_commit at the end, which also does at most one
+    checkpoint, so importing 50k rows is one process, one log write and
+    one Database_write.  The log buffer is held for the whole batch, so if
+    any line dies nothing from the batch is kept.
+12 - Implemented 'u' option to run as a server on a Unix domain socket:
+    ex17 <dbfile> u <socket>.  The server opens the database once and
+    keeps it in RAM, and clients send the same lines a batch script holds
+    ("g 3", "s 3 name email", ...).  Each reply is whatever the action
+    prints, then "OK" or "ERROR: <message>".  All the requests that arrive
+    together are run, committed with one Wal_commit (group commit across
+    clients), and only then answered.  While serving, die() jumps back to
+    the request through conn->recover instead of exiting, so a bad
+    request only fails itself.  Output goes through conn->out so it can
+    be captured per request.  SIGINT/SIGTERM checkpoint and exit.  The
+    server expects to be the only writer while it runs.  It only ever
+    removes a socket at its path (a stale one before it starts, its own
+    when it stops), and won't start over anything else that is there.
+13 - Implemented 'i' and 'x' options for bulk import and export.
+    ex17 <dbfile> i <file> streams a CSV file (TSV if the name ends in
+    .tsv) of id,name,email lines into the database in one pass: the file
+    is read WRITER_SIZE bytes at a time, parsed in place (quoted fields
+    with "" escapes are allowed, a header line is skipped), and every row
+    is put with Database_apply, replacing whatever was there, and logged.
+    The log buffer is held like a batch's, so a bad line keeps nothing;
+    at the end it is written and fsync'd in one go and one
+    Database_checkpoint writes it all, which the log can redo if it is
+    cut short.
+    ex17 <dbfile> x [file] writes every set row back out the same way
+    (stdout if no file), formatted into a Writer buffer and flushed in
+    WRITER_SIZE writes.  Database_write_dirty now uses a Writer too, so
+    all new records go out in a few big writes, and the table entries
+    are sorted and written as runs of neighbouring rows instead of one
+    pwrite per row.
+14 - 'f' uses a prefix index instead of scanning every row.  The first
+    find loads the table and builds db->index, a sorted array with one
+    (string, id) entry for every set row's name and one for its email.
+    A search term of any length is a binary search for the first entry
+    not below the term, then a walk forward while entries still start
+    with it, so it costs O(log rows + matches).  The term has to match
+    the start of a name or email in full; the old 3 character
+    Compare_terms rule is gone.  Matching ids are sorted, so results
+    still come out in id order and a row matching on both strings is
+    printed once.  Once built (in practice, by a server) set, delete and
+    anything replayed or imported through Database_apply keep the index
+    up to date with Index_add/Index_remove.  Those mark an entry
+    removed (a binary search) or add one to the end, and the next find
+    merges them all in at once (Index_merge, or sooner if more than
+    INDEX_PENDING and a sixteenth of the index pile up), so a run of
+    changes costs one O(rows) merge, not a memmove each.  'r' streams
+    the file without loading it (see 19), so there is never an index
+    for it to keep.
+15 - A one-off find scans instead of building the index.  Sorting every
+    name and email costs more than looking at each of them once, so the
+    first find on a connection is a plain scan (Database_scan) and only
+    a second one builds the index.  The scan compares the term against
+    each name and email a tile at a time: Database_scan_part packs the
+    first SCAN_WIDTH bytes of SCAN_TILE of them side by side (Scan_pack)
+    and Scan_tile matches the whole tile at once, with the AVX2 or SSE2
+    kernel Scan_init picks when the CPU has one, or a byte loop
+    otherwise (or when built with EX17_SCAN_SCALAR, which ex17_test.c
+    checks the kernels against).  AVX2 compares two names or emails per
+    instruction and hands back one bit for each of the tile's 32; a term
+    longer than SCAN_WIDTH is finished with strncmp for those that
+    match.  Packing copies SCAN_WIDTH bytes whatever a string's length,
+    and arena blocks have that much to spare at the end so this stays
+    inside what was allocated.  The scan is bound by fetching each
+    row's strings, so this is about as fast as strncmp on every string.
+16 - File format version 4 keeps the set flags apart from everything
+    else.  After the Header comes a bitmap with one bit per row, then
+    the row table, then the records, so the flags for a million rows
+    are 128KB instead of being spread through 8MB of table.  In RAM
+    db->set_bits mirrors it (Database_flag sets addr->set and the bit
+    together) and is only read when a whole-table action needs it.
+    'l', 'f', 'x' and the index walk the bitmap a 64-bit word at a time
+    and only ever touch the rows whose bit is set, Database_load reads
+    the table DB_TABLE_CHUNK entries at a time and skips chunks with no
+    set rows, and the new 'n' option counts rows from the bitmap alone.
+    Ids are never stored in the table, a row's id is its position.
+    Database_write_dirty writes the bitmap words of the rows it changes
+    along with their table entries.  Older files have no bitmap, so it
+    is worked out from their table and written on the upgrade.
+17 - Implemented 'a' option to add a row without picking its id:
+    ex17 <dbfile> a <name> <email> sets the lowest free row and prints
+    its id.  The free slots are just the zero bits of the set bitmap,
+    which is already saved with the file, so nothing new is stored.
+    To find one without walking the bitmap, db->full_bits keeps
+    DB_FULL_LEVELS more bitmaps on top of it in RAM: level 0 has a bit
+    per set_bits word that is all ones, level 1 a bit per full level 0
+    word, and so on.  Database_free_id looks through the short top level
+    and then takes one ctz per level on the way down, which is four
+    steps for anything up to 16M rows.  Database_flag updates the levels
+    as words fill up or open up, and Database_full_init builds them
+    whenever set_bits is (re)made.  'a' and 'n' can be batched and
+    served like the other row actions; a server hands out ids with no
+    race between its clients.
+18 - The row count grows by itself, so max_rows is only where a new
+    database starts.  's' on an id past the end, 'a' on a full database,
+    or an import or log record for such an id calls Database_grow, which
+    at least doubles max_rows in RAM (rows and set_bits are realloc'd,
+    the new part zeroed).  In the file (version 5) the Header gains the
+    offset of the bitmap and row table, so they no longer have to sit
+    right after it.  When Database_write_dirty finds max_rows bigger
+    than disk_rows, the rows the file has room for, Database_move_table
+    writes a bitmap and table of the new size after the records (the
+    old entries copied over, this write's entries filled in), and the
+    header is pointed at them last.  The old table becomes garbage like
+    any other record.  Records never move, and because the size at
+    least doubles each time, copying the table costs O(1) per row.
+    'r' still works for shrinking or a full rewrite.
+19 - 'r' streams the database into a new file instead of loading it.
+    Database_rewrite writes <dbfile>.resize with the new sizes one set
+    row at a time: each record is read into the scratch buffer (or taken
+    from RAM if the log changed the row), cut to the new max_data and
+    appended through a Writer, and the new table is filled in and
+    written DB_TABLE_CHUNK entries at a time.  Besides those buffers it
+    only holds the set bitmaps, so a resize of any size runs in a few
+    MB.  The finished file is fsync'd and rename()d over the old one,
+    so anyone who already has the old file open keeps reading a whole,
+    consistent database, and a crash leaves one file or the other.  The
+    log is folded into the new file, so it is emptied afterwards.  The
+    resized file is also compacted, with no garbage left in it.
+    Creating a database and upgrading an older file go the same way.
+20 - Any number of readers can run next to one writer.  Every action
+    that changes anything (s, a, d, r, i, b, u, c) takes an exclusive
+    flock() on the log when it opens the database and keeps it until it
+    exits, so writers queue up behind each other.  g, l, f, n and x
+    take no lock at all.  The header (version 6) has a generation that
+    a checkpoint makes odd while it changes pages in place and even
+    again when it is done; up to then it only appends, so readers go on
+    reading the state before it.  A reader reads the header, the log and
+    every row its action needs, then reads the header again, and starts
+    over (Database_snapshot) if it was odd or has changed.  It keeps
+    starting over for as long as a writer holds the lock, and only
+    gives up on a file a dead writer left odd.  A rewrite ('r', and
+    'c' over a file that is there) builds the new file beside the old
+    one, renames it into place and then zeroes the old file's magic, so
+    readers still on the old file notice too.  Only then is the log
+    emptied; c doesn't replay it, but a c that fails before the rename
+    leaves the old file and its log as they were.  A writer that finds
+    an odd generation knows the last one died during a checkpoint; the
+    log it left still holds every change, so replaying it puts the file
+    right.
+21 - Database_load and the scan behind a one-off 'f' run on a thread per
+    core (EX17_THREADS overrides it, the Makefile adds -pthread).
+    Scan_parallel splits the rows into runs of whole table chunks, one
+    per thread, with at least SCAN_PART_ROWS rows each, so small
+    databases still use one thread.  Each loading thread preads its own
+    table chunks and records (Database_parse_record only uses the
+    buffer it is given) and copies strings into its own arena; the
+    arenas are spliced into the database's afterwards and the rows are
+    tracked on the main thread, in id order.  Finding matches each run
+    into its own list of ids, and printing the lists one after the
+    other gives the same order as one thread would.  Threads never
+    call die(), they leave the message for the main thread.
+22 - Rows are printed through a Writer rather than one fprintf each.
+    Address_write formats a row straight into the buffer (Format_int
+    does the id, the strings are copied as they are) and g, l and f
+    hand the buffer to conn->out with a few big fwrite()s, so a list
+    costs about half what it did.  The Writer can now target a stdio
+    stream as well as a descriptor, which keeps server replies working.
+    g, l and f take an output format as an extra last argument:
+    text (the default), csv, tsv, json (an object per line, strings
+    escaped) or bin (each row as the file stores a record: id, name
+    length and email length as native ints, then the bytes), e.g.
+    ex17 <dbfile> l json.  Only text prints "not found" messages.  'x'
+    uses the same code and picks the format from the file name: .tsv,
+    .json/.jsonl and .bin, otherwise CSV.
+23 - Everything in the file is checksummed (version 7), with the same
+    CRC-32 as the log, now table driven eight bytes at a time.  Each
+    record ends in a crc of itself (bin output leaves it off).  The
+    bitmap and table are split into DB_PAGE_SIZE pages (the bitmap is
+    padded to whole pages, and a table chunk is exactly one) and a crc
+    per page is kept right after the table.  Reads check whatever they
+    read and die() with a checksum error instead of handing back
+    garbage.  A checkpoint writes each bitmap and table page it changes
+    whole, read, patched and with its new crc, rather than just the
+    changed entries.  The header is kept twice, in two DB_HEADER_SLOT
+    slots with a crc each; Database_write_header always writes the slot
+    without the newest header, and every header write raises the
+    generation, so opening the file takes the good slot with the highest
+    generation and a header write cut short costs nothing.  Nothing a
+    checkpoint changes in place (bitmap, table and hash index pages,
+    crcs, and the header last) goes to the file before it has gone to
+    the log: the writes are held (Database_stage), logged as p records
+    closed by a P and fsync'd, and only then made.  Records and a moved
+    table are appended, and fsync'd before that, so nothing on disk
+    points at them until the pages are.  A writer that finds a closed
+    set in the log makes all of its writes again before it even reads
+    the header (Wal_redo), so a page a crash left half written is
+    whole again whatever else the log holds, and a set without its P
+    was never started on.  Database_recover then checkpoints again.
+    The odd generation still tells readers to wait.  ex17_crash.c
+    ('make test') tears each page write of a checkpoint in turn and
+    checks what the next writer makes of it.
+24 - Counters for what the program spends its time on, kept in one global
+    struct Stats.  Every read, write and fsync on the database, the log
+    and the import file goes through Stats_read, Stats_write or
+    Stats_sync, which count calls and bytes, and every allocation goes
+    through Stats_malloc, Stats_calloc or Stats_realloc.  Loading
+    threads count too, so the counters only change with relaxed atomic
+    adds.  Wall time is split into open, load, op, write and close
+    phases: Database_open, the loaders, the checkpoint/commit/rewrite
+    code and main switch phase with Stats_phase on the way in and back
+    on the way out, so a load inside a rewrite is charged to load.  't'
+    (stats) loads every row and prints the sizes (rows set, record
+    bytes, file, garbage and log bytes) and then the counters; it also
+    works in batches and over the server, where the counters cover every
+    request so far.  With EX17_STATS set, any action prints the counters
+    to stderr on exit, including an exit through die().  There are no
+    Database_write_int/write_char any more and
+    Database_read_int/read_char only read version 1 files, so those are
+    counted as plain reads rather than separately.
+25 - Records can be stored compressed (version 8), chosen with an extra
+    last argument to c or r: compressed or raw (r without one keeps what
+    the file has).  The choice is the DB_COMPRESSED bit of a new header
+    flags field, which sits after the crc so version 7 headers still
+    check out, and is covered by the crc from version 8.  A compressed
+    file packs records, in id order, into blocks of at most
+    DB_BLOCK_SIZE bytes (a Packer gathers them) and each block is
+    compressed on its own with Lz_compress, a small LZ77 in the LZ4
+    block layout, behind a BlockHead with both sizes and a crc.  A
+    record's table entry holds minus its block's offset, so a g inflates
+    one block, and Database_load's threads each keep their last block
+    inflated, which makes a full load cheaper than reading raw records.
+    Checkpoints pack their dirty rows into new blocks the same way
+    (sorted by id first), a block that doesn't shrink is stored as it
+    is, and a record too big for a block is written alone.  A replaced
+    row counts its share of its block as garbage.  Rewriting a
+    compressed file as raw, or the other way round, is just an r.
+26 - A hash index on email, and optionally name (version 9), for the
+    new e action: e <email> prints the rows with exactly that email,
+    e <name> name the ones with that name.  h [email|name|both|none]
+    builds it (or drops it) from every row, as bucket pages of (hash,
+    id) pairs after the records, each with its own crc, half full so
+    it has room to grow.  The header's flags say which keys it holds,
+    and two new fields where its pages are and how many.  From then on
+    every checkpoint takes the old keys of each dirty row out of its
+    bucket (read from the record the table still points at) and puts
+    the new ones in, so the index follows Database_set and
+    Database_delete one checkpoint behind.  e makes up for that by also
+    checking the rows changed since, and checks every row it finds, so
+    a collision or a stale key never shows.  A bucket that fills gets a
+    page at the end of the file, and one that needs HASH_MAX_CHAIN
+    pages has the whole index rebuilt bigger.  r rebuilds it too.
+    Building one writes the keys to an unlinked file beside the
+    database and fills HASH_BUILD_PAGES buckets at a time from a pass
+    over it, so an r with an index still holds no more than a few
+    buffers.  Without an index, e scans the rows.
+27 - Records are read through a Reader, the read side of a Writer: it
+    keeps a buffer of the file and hands out pointers into it, and only
+    reads when the bytes asked for aren't there.  Reads that carry on
+    where the last one stopped double in size up to READER_SIZE, and
+    one that jumps somewhere else asks for just one record again, so
+    loading a file written in id order takes a few hundred big reads
+    instead of one pread of Database_record_max bytes per row, while a
+    g still reads one record and a file whose rows are scattered reads
+    no more than before.  Database_load's threads and rewrites use
+    them, and so do checkpoints for the old records of the rows they
+    change (whose table entries they read a page at a time), so
+    re-importing 200k rows reads a few thousand times, not 400k.
+    Version 1 files are parsed out of one as well, which is the
+    end of Database_read_int/read_char and their fread per field.
+    Writes already went through Writers, a few big writes each.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(EX17_SCAN_SCALAR)
+#include <immintrin.h>
+#define SCAN_SIMD 1
+#endif
+
+#define WAL_GROUP_BYTES (64 * 1024)             // flush buffered log records past this
+#define WAL_CHECKPOINT_BYTES (1024 * 1024)      // fold the log into the database past this
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+#define WRITER_SIZE (1024 * 1024)       // bytes buffered before a bulk read/write hits the file
+#define READER_SIZE (256 * 1024)        // most a Reader reads at once, while its reads run on
+
+#define BATCH_MAX_ARGS 8        // "ex17 <dbfile> s id name email" plus room to spot extras
+
+#define SCAN_WIDTH 16           // bytes of each name and email a find's scan compares at once
+#define SCAN_TILE 32            // names and emails packed and matched together
+#define SCAN_MAX_THREADS 64
+#define SCAN_PART_ROWS 65536    // a table smaller than two of these is scanned by one thread
 
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_LINE_MAX (64 * 1024)     // longest request line a client may send
+
+#define DB_MAGIC 0x4D373145     // "E17M"; version 1 files have max_data here instead
+#define DB_VERSION 9
+#define DB_HEADER_SLOT 64       // the header is kept twice, in slots this big, and written in turn
+#define DB_PAGE_SIZE 4096       // the bitmap and table are checksummed in pages this big
+#define DB_TABLE_CHUNK 512      // table entries in a page, what Database_load reads at once
+#define DB_FULL_LEVELS 3        // summary bitmaps over set_bits for Database_free_id
+#define DB_SNAPSHOT_TRIES 200   // times a reader starts over before seeing if a writer is alive
+#define DB_SNAPSHOT_WAIT 5000   // microseconds between tries
+#define DB_COMPRESSED 1         // header flag: records are packed into blocks, version 8 and up
+#define DB_BLOCK_SIZE 8192      // most record bytes a block holds, bigger records go alone
+#define DB_HASH_EMAIL 2         // header flags: the hash index has emails in it, version 9 and up
+#define DB_HASH_NAME 4          // and names
+#define DB_HASH_KEYS (DB_HASH_EMAIL | DB_HASH_NAME)
+
+#define HASH_PAGE_ENTRIES 510   // what fits in a DB_PAGE_SIZE bucket page after its head
+#define HASH_FILL 255           // keys per bucket when the index is built, half full
+#define INDEX_PENDING 4096       // changes Index_add/Index_remove hold back at least, see Index_merge
+#define HASH_MAX_CHAIN 4        // a bucket with this many pages gets the index rebuilt bigger
+#define HASH_BUILD_PAGES 4096   // bucket pages Hash_write fills at a time (16MB)
+
+#define LZ_HASH_BITS 12         // the compressor remembers 4096 recent positions
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+#define STATS_OPEN 0            // phases the wall time is split into, see Stats_phase
+#define STATS_LOAD 1
+#define STATS_OP 2
+#define STATS_WRITE 3
+#define STATS_CLOSE 4
+#define STATS_PHASES 5
 
 struct Address {
     int id;
     int set;
     char *name;
     char *email;
+    int loaded;     // read from the file (or the log) into RAM
+    int dirty;      // changed in RAM since the last Database_write
+    int disk_size;  // bytes of this row's record in the file, 0 if none, -1 if unknown
+};
+
+struct Header {
+    int magic;
+    int version;
+    int max_data;
+    int max_rows;
+    int64_t garbage;    // bytes of records no table entry points at any more
+    int64_t table;      // where the bitmap and row table start, versions 5 and up
+    int64_t generation; // odd while a checkpoint is changing the file, version 6 and up
+    uint32_t crc;       // of everything above, version 7 and up
+    int flags;          // DB_COMPRESSED, version 8 and up, and in the crc from then
+    int64_t hash;       // where the hash index's bucket pages start, 0 if there is none
+    int hash_buckets;   // version 9 and up
+};
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    long used;
+    long size;
+    char data[];
+};
+
+struct IndexEntry {
+    const char *key;    // a set row's name or email, in the arena
+    int id;
+    int removed;        // taken out since the last Index_merge, still in order
+};
+
+struct Reader {
+    char *buf;
+    long size;          // bytes allocated for buf
+    long cap;           // most one read asks for, 0 for just what is needed
+    long next;          // what the next read asks for, doubling while they run on
+    int64_t at;         // file offset of buf[0]
+    long len;           // bytes in buf
+};
+
+struct Block {
+    int64_t at;         // file offset of the block inflated in raw, 0 if none
+    long size;          // raw bytes
+    long packed_size;   // bytes it takes up in the file, less its head
+    long next;          // where the record after the last one found starts
+    char *raw;          // DB_BLOCK_SIZE bytes each, allocated on first use
+    char *packed;
+};
+
+struct BlockHead {
+    uint32_t raw_size;
+    uint32_t packed_size;   // the same as raw_size if it didn't compress
+    uint32_t crc;           // of the two sizes and the packed bytes
+};
+
+struct Packer {
+    struct Writer *records; // where finished blocks go
+    char raw[DB_BLOCK_SIZE];
+    long len;
+    int64_t *waiting[DB_BLOCK_SIZE / 16];   // table entries for the records in raw
+    int count;
+    char packed[DB_BLOCK_SIZE];
+};
+
+struct HashEntry {
+    uint32_t hash;      // Hash_key of a name or email
+    int id;
+};
+
+struct HashPage {
+    uint32_t crc;       // of the rest of the page
+    int count;
+    int64_t next;       // the bucket's next page, 0 if this is the last
+    struct HashEntry entries[HASH_PAGE_ENTRIES];
+};
+
+struct HashOp {
+    uint32_t hash;
+    int id;
+    long bucket;
+    long order;         // ops on one bucket are applied in the order they were made
+    int add;            // or remove
 };
 
 struct Database {
     int max_data;
     int max_rows;
+    int version;
+    int flags;
+    int64_t hash;           // the hash index's bucket pages, see Hash_write
+    int hash_buckets;
+    int hash_grow;          // a bucket got too long, rebuild the index after this checkpoint
+    int *hits;              // e: the rows the hash index had for the key, see Hash_find
+    long hit_count;
+    int64_t garbage;
+    int rewrite;    // header or row sizes changed, so Database_write must rewrite the whole file
     void *rows; // Database_open will dynamically malloc the appropriate memory size.
                 // This lets us avoid any array size specifications here.
                 // We then use a typecast pointer to access rows as Addresses.
+    int *loaded_ids;    // every row with loaded set, so nothing has to walk all of rows
+    int loaded_count;
+    int loaded_cap;
+    struct ArenaBlock *arena;   // where every name and email lives
+    struct Reader reader;       // for reading records, one at a time unless a rewrite says
+    struct Block block; // the block the last packed record was read from
+    struct IndexEntry *index;   // sorted names and emails, NULL until the first find
+    long index_count;
+    long index_cap;
+    long index_sorted;  // index[index_sorted..] are added since the last Index_merge
+    long index_removed; // entries before index_sorted marked removed
+    int finds;      // finds run so far, the second one builds the index
+    uint64_t *set_bits;     // one bit per row, NULL until something needs it
+    int all_loaded;         // every set row is in RAM
+    int disk_rows;          // rows the file's bitmap and table have room for
+    int64_t table;          // where they start in the file
+    int64_t generation;
+    int header_slot;        // the slot the newest header is in
+    char seen[2 * DB_HEADER_SLOT];  // both slots as they were read, to spot writers
+    uint64_t *full_bits[DB_FULL_LEVELS];    // which words of the level below are all ones
+};
+
+struct Writer {
+    int fd;
+    int64_t offset;     // file offset of buf[0], or -1 to just write() (pipes, stdout)
+    FILE *file;         // or a stream to fwrite() to instead of fd
+    char *buf;
+    long len;
+};
+
+struct Entry {
+    int id;
+    int64_t offset;
+};
+
+struct ScanPart {
+    struct Connection *conn;
+    int start;          // rows start to end - 1, start a multiple of DB_TABLE_CHUNK
+    int end;
+    const char *term;   // find: the term
+    long len;
+    int *ids;           // find: the rows that matched, in id order
+    long count;
+    long cap;
+    struct ArenaBlock *arena;   // load: this part's names and emails
+    struct Reader reader;
+    struct Block block;
+    const char *error;  // only the main thread may die()
 };
 
 struct Connection {
     FILE *file;
     struct Database *db;
+    int wal;            // write-ahead log file descriptor
+    long wal_size;      // bytes of committed records in the log
+    char *wal_buf;      // records appended but not yet committed
+    long wal_len;
+    long wal_cap;
+    int wal_unsynced;   // records written to the log since the last fsync
+    int wal_uncommitted;        // records appended since the last commit record
+    int wal_pages;      // Wal_redo found a checkpoint's page writes in the log
+    char *staged;       // page writes Database_stage is holding for Wal_log_staged
+    long staged_len;
+    long staged_cap;
+    int wal_hold;       // keep every record in wal_buf until the commit (batches)
+    FILE *out;          // where actions print their results
+    jmp_buf *recover;   // set while serving, die() jumps here instead of exiting
+    char error[256];    // the message die() was called with
+    char *path;         // the database file, to replace it on a rewrite
+    int writer;         // holds the lock on the log, readers don't lock
+    struct Writer print;    // rows on their way to out, see Database_printer
+    char format;        // how g, l and f print rows, see Address_write
 };
 
-void Database_close(struct Connection *conn)
+struct Stats {
+    long reads;         // read calls on the database, log and import files
+    long read_bytes;
+    long writes;        // write calls on them, and flushes of printed rows
+    long write_bytes;
+    long printed;       // bytes of write_bytes that were results, not the database
+    long syncs;
+    long allocs;        // malloc, calloc and realloc calls
+    long alloc_bytes;
+    int phase;          // what the time is being spent on now
+    double phase_start;
+    double phase_ms[STATS_PHASES];
+};
+
+// one set per process; loading threads add to it too, so the counters
+// are only ever changed with atomic adds
+struct Stats Stats;
+
+const char *Stats_names[STATS_PHASES] = { "open", "load", "op", "write", "close" };
+
+#define STATS_ADD(field, n) __atomic_fetch_add(&Stats.field, (n), __ATOMIC_RELAXED)
+
+double Stats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+long Stats_read(long rc)
+{
+    // counts a read that returned rc and hands rc back
+    STATS_ADD(reads, 1);
+    if(rc > 0){
+        STATS_ADD(read_bytes, rc);
+    }
+    return rc;
+}
+
+long Stats_write(long rc)
+{
+    STATS_ADD(writes, 1);
+    if(rc > 0){
+        STATS_ADD(write_bytes, rc);
+    }
+    return rc;
+}
+
+int Stats_sync(int rc)
+{
+    STATS_ADD(syncs, 1);
+    return rc;
+}
+
+void *Stats_malloc(long size)
+{
+    STATS_ADD(allocs, 1);
+    STATS_ADD(alloc_bytes, size);
+    return malloc(size);
+}
+
+void *Stats_calloc(long count, long size)
+{
+    STATS_ADD(allocs, 1);
+    STATS_ADD(alloc_bytes, count * size);
+    return calloc(count, size);
+}
+
+void *Stats_realloc(void *p, long size)
+{
+    STATS_ADD(allocs, 1);
+    STATS_ADD(alloc_bytes, size);
+    return realloc(p, size);
+}
+
+int Stats_phase(int phase)
+// charge the time since the last switch to the phase that was running,
+// start timing phase and return the one it took over from, so a
+// function can switch on the way in and back on the way out.  Only the
+// main thread switches.
+{
+    double now = Stats_now();
+    int was = Stats.phase;
+
+    Stats.phase_ms[was] += now - Stats.phase_start;
+    Stats.phase = phase;
+    Stats.phase_start = now;
+
+    return was;
+}
+
+void Stats_print(FILE *out)
 {
+    double total = 0;
     int i = 0;
 
+    // bring the running phase up to date first
+    Stats_phase(Stats.phase);
+
+    fprintf(out, "reads: %ld (%ld bytes)\n", Stats.reads, Stats.read_bytes);
+    fprintf(out, "writes: %ld (%ld bytes, %ld of them printed)\n", Stats.writes,
+            Stats.write_bytes, Stats.printed);
+    fprintf(out, "syncs: %ld\n", Stats.syncs);
+    fprintf(out, "allocs: %ld (%ld bytes)\n", Stats.allocs, Stats.alloc_bytes);
+    for(i = 0; i < STATS_PHASES; i++){
+        fprintf(out, "%s: %.3f ms\n", Stats_names[i], Stats.phase_ms[i]);
+        total += Stats.phase_ms[i];
+    }
+    fprintf(out, "total: %.3f ms\n", total);
+}
+
+void Stats_dump()
+{
+    // atexit handler, see Stats_start
+    fprintf(stderr, "--- ex17 stats\n");
+    Stats_print(stderr);
+}
+
+void Stats_start()
+{
+    // the clock starts at the top of main; EX17_STATS asks for the
+    // counters on stderr when the program exits, however it exits
+    char *env = getenv("EX17_STATS");
+
+    Stats.phase = STATS_OPEN;
+    Stats.phase_start = Stats_now();
+    if(env && env[0] && strcmp(env, "0") != 0){
+        atexit(Stats_dump);
+    }
+}
+
+void *Arena_alloc(struct ArenaBlock **arena, long size)
+{
+    // bump-allocate from the newest block, starting a new one when it's full
+    struct ArenaBlock *block = *arena;
+
+    if(!block || block->used + size > block->size){
+        long block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        // with SCAN_WIDTH bytes past the end for Scan_pack to read
+        block = Stats_malloc(sizeof(struct ArenaBlock) + block_size + SCAN_WIDTH);
+        if(!block){
+            return NULL;
+        }
+        block->next = *arena;
+        block->used = 0;
+        block->size = block_size;
+        *arena = block;
+    }
+
+    void *p = block->data + block->used;
+    block->used += size;
+
+    return p;
+}
+
+void Arena_destroy(struct ArenaBlock *arena)
+{
+    while(arena){
+        struct ArenaBlock *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+char *Reader_get(int fd, struct Reader *r, int64_t at, long need, long *got)
+// the file's bytes from at, need of them or all there are before the
+// end of the file (*got says how many, it can be more).  The file is
+// only read when they aren't in buf already.  Reads that start where
+// the last one ended double in size up to r->cap, so reading a run of
+// neighbouring records costs a few big reads, and one that jumps
+// elsewhere asks for just need again.  NULL if the read fails; it
+// never calls die(), so threads can use it.
+{
+    if(at < r->at || at + need > r->at + r->len){
+        r->next = at >= r->at && at <= r->at + r->len ? 2 * r->next : 0;
+        r->next = r->next < r->cap ? r->next : r->cap;
+        r->next = r->next > need ? r->next : need;
+
+        if(r->next > r->size){
+            char *buf = Stats_realloc(r->buf, r->next);
+            if(!buf){
+                return NULL;
+            }
+            r->buf = buf;
+            r->size = r->next;
+        }
+        r->at = at;
+        r->len = Stats_read(pread(fd, r->buf, r->next, at));
+        if(r->len < 0){
+            r->len = 0;
+            return NULL;
+        }
+    }
+
+    *got = r->at + r->len - at;
+    return r->buf + (at - r->at);
+}
+
+void Reader_close(struct Reader *r)
+{
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+void Block_free(struct Block *block)
+{
+    free(block->raw);
+    free(block->packed);
+    memset(block, 0, sizeof(*block));
+}
+
+void Database_close(struct Connection *conn)
+{
     if(conn) {
         if(conn->file){
             fclose(conn->file);
         }
+        if(conn->wal != -1){
+            close(conn->wal);
+        }
+        if(conn->wal_buf){
+            free(conn->wal_buf);
+        }
+        free(conn->staged);
+        if(conn->path){
+            free(conn->path);
+        }
+        if(conn->print.buf){
+            free(conn->print.buf);
+        }
         if(conn->db){
-            for(i = 0; i < conn->db->max_rows; i++){
-                struct Address *addr = &((struct Address *)conn->db->rows)[i];
-                if(addr->name){
-                    free(addr->name);
-                }
-                if(addr->email){
-                    free(addr->email);
-                }
+            Arena_destroy(conn->db->arena);
+            if(conn->db->rows){
+                free(conn->db->rows);
+            }
+            if(conn->db->loaded_ids){
+                free(conn->db->loaded_ids);
+            }
+            Reader_close(&conn->db->reader);
+            Block_free(&conn->db->block);
+            if(conn->db->index){
+                free(conn->db->index);
+            }
+            free(conn->db->hits);
+            if(conn->db->set_bits){
+                free(conn->db->set_bits);
+            }
+            for(int level = 0; level < DB_FULL_LEVELS; level++){
+                free(conn->db->full_bits[level]);
             }
-            free(conn->db->rows);
             free(conn->db);
         }
-        free(conn);
+        free(conn);
+    }
+}
+
+void die(const char *message, struct Connection *conn)
+{
+    // serving a request: fail the request, not the server
+    if(conn && conn->recover){
+        if(errno){
+            snprintf(conn->error, sizeof(conn->error), "%s: %s", message, strerror(errno));
+        } else {
+            snprintf(conn->error, sizeof(conn->error), "%s", message);
+        }
+        errno = 0;
+        longjmp(*conn->recover, 1);
+    }
+
+    if(errno){
+        perror(message);
+    } else {
+        printf("ERROR: %s\n", message);
+    }
+
+    Database_close(conn);
+
+    exit(1);
+}
+
+void Writer_open(struct Connection *conn, struct Writer *w, int fd, int64_t offset)
+{
+    w->fd = fd;
+    w->offset = offset;
+    w->file = NULL;
+    w->len = 0;
+    w->buf = Stats_malloc(WRITER_SIZE);
+    if(!w->buf){
+        die("Memory error", conn);
+    }
+}
+
+void Writer_flush(struct Connection *conn, struct Writer *w)
+{
+    long done = 0;
+
+    // streams and plain write()s carry results (g, l, f and x), not the database
+    if(w->file || w->offset < 0){
+        STATS_ADD(printed, w->len);
+    }
+
+    if(w->file){
+        if(Stats_write(fwrite(w->buf, 1, w->len, w->file)) != w->len){
+            die("Failed to write", conn);
+        }
+        w->len = 0;
+        return;
+    }
+
+    while(done < w->len){
+        long rc = Stats_write(w->offset < 0 ? write(w->fd, w->buf + done, w->len - done)
+                                            : pwrite(w->fd, w->buf + done, w->len - done, w->offset + done));
+        if(rc <= 0){
+            die("Failed to write", conn);
+        }
+        done += rc;
+    }
+
+    if(w->offset >= 0){
+        w->offset += w->len;
+    }
+    w->len = 0;
+}
+
+void Writer_put(struct Connection *conn, struct Writer *w, const void *data, long len)
+{
+    // anything bigger than the buffer goes straight through
+    if(w->len + len > WRITER_SIZE){
+        Writer_flush(conn, w);
+    }
+    if(len > WRITER_SIZE){
+        char *buf = w->buf;
+        w->buf = (char *)data;
+        w->len = len;
+        Writer_flush(conn, w);
+        w->buf = buf;
+        return;
+    }
+
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+void Writer_close(struct Connection *conn, struct Writer *w)
+{
+    Writer_flush(conn, w);
+    free(w->buf);
+    w->buf = NULL;
+}
+
+void Writer_field(struct Connection *conn, struct Writer *w, const char *field, char delim)
+// quote a field only if it needs it, doubling any quotes inside
+{
+    if(!strchr(field, delim) && !strpbrk(field, "\"\r\n")){
+        Writer_put(conn, w, field, strlen(field));
+        return;
+    }
+
+    Writer_put(conn, w, "\"", 1);
+    for(const char *quote = strchr(field, '"'); quote; quote = strchr(field, '"')){
+        Writer_put(conn, w, field, quote - field + 1);
+        Writer_put(conn, w, "\"", 1);
+        field = quote + 1;
+    }
+    Writer_put(conn, w, field, strlen(field));
+    Writer_put(conn, w, "\"", 1);
+}
+
+void Writer_json(struct Connection *conn, struct Writer *w, const char *str)
+// str as the inside of a JSON string: quotes, backslashes and control
+// characters escaped, everything else (UTF-8 included) as it is
+{
+    char escape[8];
+
+    while(*str){
+        long run = 0;
+        while(str[run] && str[run] != '"' && str[run] != '\\' && (unsigned char)str[run] >= 0x20){
+            run++;
+        }
+        Writer_put(conn, w, str, run);
+        str += run;
+
+        if(*str){
+            int len = snprintf(escape, sizeof(escape), *str == '"' || *str == '\\' ? "\\%c" : "\\u%04x",
+                    (unsigned char)*str);
+            Writer_put(conn, w, escape, len);
+            str++;
+        }
+    }
+}
+
+int Format_int(char *dest, int value)
+{
+    // value in decimal, unterminated; printf's parsing costs more than the rest of a row
+    char digits[12];
+    unsigned int n = value < 0 ? -(unsigned int)value : (unsigned int)value;
+    int len = 0;
+    int i = 0;
+
+    do {
+        digits[len++] = '0' + n % 10;
+        n /= 10;
+    } while(n);
+
+    if(value < 0){
+        dest[i++] = '-';
+    }
+    while(len){
+        dest[i++] = digits[--len];
+    }
+
+    return i;
+}
+
+void Address_write(struct Connection *conn, struct Writer *w, struct Address *addr, char format)
+// one row in an output format: 't' is the usual "id name email",
+// 'c' and 'v' are CSV and TSV lines, 'j' a JSON object per line, and
+// 'b' the record as the file keeps it less its crc (id, name length,
+// email length, then the bytes, ints in this machine's byte order)
+{
+    char num[32];
+    int len = 0;
+
+    switch(format) {
+        case 'b': {
+            int head[3] = {addr->id, strlen(addr->name), strlen(addr->email)};
+            Writer_put(conn, w, head, sizeof(head));
+            Writer_put(conn, w, addr->name, head[1]);
+            Writer_put(conn, w, addr->email, head[2]);
+            break;
+        }
+        case 'j':
+            len = snprintf(num, sizeof(num), "{\"id\":%d,\"name\":\"", addr->id);
+            Writer_put(conn, w, num, len);
+            Writer_json(conn, w, addr->name);
+            Writer_put(conn, w, "\",\"email\":\"", 11);
+            Writer_json(conn, w, addr->email);
+            Writer_put(conn, w, "\"}\n", 3);
+            break;
+        case 'c':
+        case 'v': {
+            char delim = format == 'c' ? ',' : '\t';
+            len = Format_int(num, addr->id);
+            num[len++] = delim;
+            Writer_put(conn, w, num, len);
+            Writer_field(conn, w, addr->name, delim);
+            Writer_put(conn, w, &delim, 1);
+            Writer_field(conn, w, addr->email, delim);
+            Writer_put(conn, w, "\n", 1);
+            break;
+        }
+        default:
+            len = Format_int(num, addr->id);
+            num[len++] = ' ';
+            Writer_put(conn, w, num, len);
+            Writer_put(conn, w, addr->name, strlen(addr->name));
+            Writer_put(conn, w, " ", 1);
+            Writer_put(conn, w, addr->email, strlen(addr->email));
+            Writer_put(conn, w, "\n", 1);
+    }
+}
+
+char Database_format(struct Connection *conn, const char *name)
+{
+    // the Address_write format called name
+    const char *names[] = {"text", "csv", "tsv", "json", "bin"};
+    const char *formats = "tcvjb";
+
+    for(int i = 0; formats[i]; i++){
+        if(strcmp(name, names[i]) == 0){
+            return formats[i];
+        }
+    }
+
+    die("Unknown format, only: text, csv, tsv, json, bin", conn);
+    return 't';
+}
+
+int Database_storage(struct Connection *conn, const char *name, int flags)
+{
+    // flags with compression turned on or off as c and r are asked to
+    if(strcmp(name, "compressed") == 0){
+        return flags | DB_COMPRESSED;
+    }
+    if(strcmp(name, "raw") == 0){
+        return flags & ~DB_COMPRESSED;
+    }
+
+    die("Unknown storage, only: compressed, raw", conn);
+    return flags;
+}
+
+struct Writer *Database_printer(struct Connection *conn)
+{
+    // rows for conn->out pile up here and go out in a few big writes
+    if(!conn->print.buf){
+        Writer_open(conn, &conn->print, -1, -1);
+    }
+    conn->print.file = conn->out;
+
+    return &conn->print;
+}
+
+uint32_t Crc32_table[8][256];
+
+void Crc32_init()
+{
+    // table 0 is the usual byte at a time table, table k is the crc of
+    // a byte followed by k zero bytes, for Crc32_update's eight at a time
+    uint32_t crc = 0;
+    int i = 0;
+    int k = 0;
+
+    if(Crc32_table[0][1]){
+        return;
+    }
+
+    for(i = 0; i < 256; i++){
+        crc = i;
+        for(k = 0; k < 8; k++){
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+        Crc32_table[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++){
+        for(k = 1; k < 8; k++){
+            crc = Crc32_table[k - 1][i];
+            Crc32_table[k][i] = (crc >> 8) ^ Crc32_table[0][crc & 0xFF];
+        }
+    }
+}
+
+uint32_t Crc32_update(uint32_t crc, const void *data, long len)
+// CRC-32 (IEEE) of data carried on from crc, the crc of whatever came
+// before it (0 to start).  Crc32_init must have run.
+{
+    const unsigned char *p = data;
+
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for(; len >= 8; len -= 8, p += 8){
+        uint32_t one = 0;
+        uint32_t two = 0;
+        memcpy(&one, p, 4);
+        memcpy(&two, p + 4, 4);
+        one ^= crc;
+        crc = Crc32_table[7][one & 0xFF] ^ Crc32_table[6][(one >> 8) & 0xFF]
+            ^ Crc32_table[5][(one >> 16) & 0xFF] ^ Crc32_table[4][one >> 24]
+            ^ Crc32_table[3][two & 0xFF] ^ Crc32_table[2][(two >> 8) & 0xFF]
+            ^ Crc32_table[1][(two >> 16) & 0xFF] ^ Crc32_table[0][two >> 24];
+    }
+#endif
+    for(; len > 0; len--, p++){
+        crc = (crc >> 8) ^ Crc32_table[0][(crc ^ *p) & 0xFF];
+    }
+
+    return ~crc;
+}
+
+uint32_t Crc32_compute(const void *data, long len)
+{
+    return Crc32_update(0, data, len);
+}
+
+uint32_t Header_crc(struct Header *head)
+{
+    // everything but the crc itself; flags came after it in version 8, the hash index in 9
+    uint32_t crc = Crc32_compute(head, offsetof(struct Header, crc));
+    long end = head->version >= 9 ? (long)offsetof(struct Header, hash_buckets) + sizeof(int)
+             : (long)offsetof(struct Header, hash);
+
+    if(head->version >= 8){
+        crc = Crc32_update(crc, &head->flags, end - offsetof(struct Header, flags));
+    }
+    return crc;
+}
+
+long Lz_sequence(unsigned char *dst, long out, long cap, const unsigned char *lits,
+        long lit_len, long offset, long match)
+// one sequence: a token holding both lengths (15 meaning more bytes
+// follow, each added on until one isn't 255), the literals, then the
+// match's 2 byte offset; the last sequence has literals only.
+// Returns the new end of dst, or -1 past cap.
+{
+    long m = match ? match - LZ_MIN_MATCH : 0;
+    long need = 1 + lit_len + lit_len / 255 + 1 + (match ? 2 + m / 255 + 1 : 0);
+
+    if(out + need > cap){
+        return -1;
+    }
+
+    dst[out++] = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+    if(lit_len >= 15){
+        long n = lit_len - 15;
+        for(; n >= 255; n -= 255){
+            dst[out++] = 255;
+        }
+        dst[out++] = n;
+    }
+    memcpy(dst + out, lits, lit_len);
+    out += lit_len;
+
+    if(match){
+        dst[out++] = offset & 0xff;
+        dst[out++] = offset >> 8;
+        if(m >= 15){
+            long n = m - 15;
+            for(; n >= 255; n -= 255){
+                dst[out++] = 255;
+            }
+            dst[out++] = n;
+        }
+    }
+
+    return out;
+}
+
+long Lz_compress(const void *data, long len, void *dest, long cap)
+// LZ77 with the LZ4 block layout: greedy matches of at least
+// LZ_MIN_MATCH bytes found through a hash of the next 4 bytes.
+// Returns the packed size, or -1 if it doesn't fit in cap.
+{
+    const unsigned char *src = data;
+    unsigned char *dst = dest;
+    int32_t last[1 << LZ_HASH_BITS];
+    long anchor = 0;
+    long out = 0;
+    long i = 0;
+
+    memset(last, 0xff, sizeof(last));
+
+    while(i + LZ_MIN_MATCH <= len){
+        uint32_t v = 0;
+        memcpy(&v, src + i, sizeof(v));
+        uint32_t h = (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+        long from = last[h];
+
+        last[h] = i;
+        if(from < 0 || i - from > LZ_MAX_OFFSET || memcmp(src + from, src + i, LZ_MIN_MATCH) != 0){
+            i++;
+            continue;
+        }
+
+        long match = LZ_MIN_MATCH;
+        while(i + match < len && src[from + match] == src[i + match]){
+            match++;
+        }
+        out = Lz_sequence(dst, out, cap, src + anchor, i - anchor, i - from, match);
+        if(out < 0){
+            return -1;
+        }
+        i += match;
+        anchor = i;
+    }
+
+    return Lz_sequence(dst, out, cap, src + anchor, len - anchor, 0, 0);
+}
+
+long Lz_length(const unsigned char *src, long len, long *in)
+{
+    // the bytes that extend a length of 15
+    long n = 0;
+    int byte = 255;
+
+    while(byte == 255){
+        if(*in >= len){
+            return -1;
+        }
+        byte = src[(*in)++];
+        n += byte;
+    }
+
+    return n;
+}
+
+long Lz_decompress(const void *data, long len, void *dest, long cap)
+// undo Lz_compress, checking every length and offset against the
+// buffers; returns the raw size, or -1 if data isn't a valid block
+{
+    const unsigned char *src = data;
+    unsigned char *dst = dest;
+    long in = 0;
+    long out = 0;
+
+    while(in < len){
+        int token = src[in++];
+        long lits = token >> 4;
+        long match = token & 15;
+
+        if(lits == 15){
+            long more = Lz_length(src, len, &in);
+            if(more < 0){
+                return -1;
+            }
+            lits += more;
+        }
+        if(lits > len - in || lits > cap - out){
+            return -1;
+        }
+        memcpy(dst + out, src + in, lits);
+        in += lits;
+        out += lits;
+
+        // only the last sequence ends without a match
+        if(in == len){
+            break;
+        }
+        if(len - in < 2){
+            return -1;
+        }
+        long offset = src[in] | (long)src[in + 1] << 8;
+        in += 2;
+        if(match == 15){
+            long more = Lz_length(src, len, &in);
+            if(more < 0){
+                return -1;
+            }
+            match += more;
+        }
+        match += LZ_MIN_MATCH;
+        if(offset == 0 || offset > out || match > cap - out){
+            return -1;
+        }
+        // byte by byte, the match may overlap what it is copying
+        for(long k = 0; k < match; k++){
+            dst[out + k] = dst[out - offset + k];
+        }
+        out += match;
+    }
+
+    return out;
+}
+
+void Database_read_header(struct Connection *conn)
+// version 2 and later files start with DB_MAGIC and a Header,
+// which has grown over the versions; version 1 files start
+// straight away with max_data and max_rows, and have no row
+// table.  Version 7 files keep two copies of the header with a
+// crc each and the newest good one is used, so a header write
+// that was cut short just leaves the one before it.  Anything
+// older than DB_VERSION is rewritten in the current format on
+// its next write.
+{
+    struct Database *db = conn->db;
+    struct Header head = {0};
+    struct Header other = {0};
+    long rc = Stats_read(pread(fileno(conn->file), db->seen, sizeof(db->seen), 0));
+
+    if(rc < (long)(2 * sizeof(int))){
+        die("Failed to read database header", conn);
+    }
+    memcpy(&head, db->seen, sizeof(head));
+    memcpy(&other, db->seen + DB_HEADER_SLOT, sizeof(other));
+
+    // the first slot may be the one that was cut short
+    if((head.magic == DB_MAGIC && head.version >= 7)
+            || (other.magic == DB_MAGIC && other.version >= 7 && Header_crc(&other) == other.crc)){
+        int good = rc == sizeof(db->seen) && head.magic == DB_MAGIC && Header_crc(&head) == head.crc;
+        int other_good = rc == sizeof(db->seen) && other.magic == DB_MAGIC && Header_crc(&other) == other.crc;
+
+        if(!good && !other_good){
+            die("Database header is corrupt", conn);
+        }
+        db->header_slot = other_good && (!good || other.generation > head.generation);
+        if(db->header_slot){
+            head = other;
+        }
+    }
+
+    if(head.magic == DB_MAGIC){
+        long size = head.version >= 6 ? (long)offsetof(struct Header, crc)
+                  : head.version == 5 ? (long)offsetof(struct Header, generation)
+                  : (long)offsetof(struct Header, table);
+        if(rc < size){
+            die("Failed to read database header", conn);
+        }
+        if(head.version > DB_VERSION){
+            die("Database was written by a newer version", conn);
+        }
+        db->version = head.version;
+        db->max_data = head.max_data;
+        db->max_rows = head.max_rows;
+        db->garbage = head.garbage;
+        db->rewrite = head.version < DB_VERSION;
+        // before version 5 the table came right after a shorter header
+        db->table = head.version >= 5 ? head.table : (int64_t)offsetof(struct Header, table);
+        db->generation = head.version >= 6 ? head.generation : 0;
+        db->flags = head.version >= 8 ? head.flags : 0;
+        db->hash = head.version >= 9 ? head.hash : 0;
+        db->hash_buckets = head.version >= 9 ? head.hash_buckets : 0;
+    } else {
+        db->version = 1;
+        db->max_data = head.magic;
+        db->max_rows = head.version;
+        db->rewrite = 1;
+    }
+    db->disk_rows = db->max_rows;
+}
+
+int Database_unchanged(struct Connection *conn)
+{
+    // no writer has touched the header (so nothing else either) since we read it
+    char seen[sizeof(conn->db->seen)] = {0};
+
+    Stats_read(pread(fileno(conn->file), seen, sizeof(seen), 0));
+
+    return memcmp(seen, conn->db->seen, sizeof(seen)) == 0;
+}
+
+long Database_bits_size(long rows)
+{
+    // bytes of a set bitmap for this many rows
+    return (rows + 63) / 64 * sizeof(uint64_t);
+}
+
+long Database_bits_space(struct Database *db, long rows)
+{
+    // room the bitmap takes up in the file, whole pages from version 7
+    long size = db->version >= 4 ? Database_bits_size(rows) : 0;
+
+    return db->version >= 7 ? (size + DB_PAGE_SIZE - 1) / DB_PAGE_SIZE * DB_PAGE_SIZE : size;
+}
+
+long Database_entry_offset(struct Database *db, int id)
+{
+    // the row table follows the bitmap (versions 4 and up) in the file
+    return db->table + Database_bits_space(db, db->disk_rows) + (long)id * sizeof(int64_t);
+}
+
+long Database_sum_offset(struct Database *db, long page)
+{
+    // a crc per page of bitmap and table follows the table (version 7)
+    return Database_entry_offset(db, db->disk_rows) + page * sizeof(uint32_t);
+}
+
+const char *Database_read_chunk(struct Database *db, int fd, int chunk, int64_t *table, long *size)
+// reads the table entries of one chunk (one page) into table, checking
+// the page's crc in version 7 files.  size is set to the bytes read,
+// less than a page for the last chunk.  Returns what went wrong, or
+// NULL; it doesn't die() so that threads can call it.
+{
+    long count = db->disk_rows - (long)chunk * DB_TABLE_CHUNK;
+    uint32_t sum = 0;
+
+    *size = (count < DB_TABLE_CHUNK ? count : DB_TABLE_CHUNK) * sizeof(int64_t);
+    if(Stats_read(pread(fd, table, *size, Database_entry_offset(db, chunk * DB_TABLE_CHUNK))) != *size){
+        return "Failed to read row table";
+    }
+
+    if(db->version >= 7){
+        long page = Database_bits_space(db, db->disk_rows) / DB_PAGE_SIZE + chunk;
+        if(Stats_read(pread(fd, &sum, sizeof(sum), Database_sum_offset(db, page))) != sizeof(sum)){
+            return "Failed to read row table";
+        }
+        if(sum != Crc32_compute(table, *size)){
+            return "Row table page failed its checksum";
+        }
+    }
+
+    return NULL;
+}
+
+void Database_stage(struct Connection *conn, int64_t at, const void *data, int len)
+// hold a write that changes the file in place until Wal_log_staged
+// has put it in the log; the offset, the length, then the bytes
+{
+    long need = conn->staged_len + (long)sizeof(at) + sizeof(len) + len;
+
+    if(need > conn->staged_cap){
+        long cap = conn->staged_cap ? conn->staged_cap : 65536;
+        while(cap < need){
+            cap *= 2;
+        }
+        char *buf = Stats_realloc(conn->staged, cap);
+        if(!buf){
+            die("Memory error", conn);
+        }
+        conn->staged = buf;
+        conn->staged_cap = cap;
+    }
+
+    char *rec = conn->staged + conn->staged_len;
+    memcpy(rec, &at, sizeof(at));
+    memcpy(rec + sizeof(at), &len, sizeof(len));
+    memcpy(rec + sizeof(at) + sizeof(len), data, len);
+    conn->staged_len = need;
+}
+
+void Database_write_page(struct Connection *conn, long page, const void *data, long size)
+{
+    // a page of bitmap or table, then its new crc, both through Database_stage
+    struct Database *db = conn->db;
+    uint32_t sum = Crc32_compute(data, size);
+
+    Database_stage(conn, db->table + page * DB_PAGE_SIZE, data, size);
+    Database_stage(conn, Database_sum_offset(db, page), &sum, sizeof(sum));
+}
+
+long Database_level_words(struct Database *db, int level)
+{
+    // words in full_bits[level], or in set_bits for level -1
+    long words = ((long)db->max_rows + 63) / 64;
+
+    for(; level >= 0; level--){
+        words = (words + 63) / 64;
+    }
+
+    return words;
+}
+
+void Database_mark_full(struct Database *db, long word, int full)
+// set_bits[word] just filled up or opened up, pass that up the
+// levels for as long as it changes whether a word is full
+{
+    int level = 0;
+
+    for(level = 0; level < DB_FULL_LEVELS; level++){
+        uint64_t *bits = &db->full_bits[level][word / 64];
+        int was_full = *bits == ~(uint64_t)0;
+
+        if(full){
+            *bits |= (uint64_t)1 << (word % 64);
+        } else {
+            *bits &= ~((uint64_t)1 << (word % 64));
+        }
+        if((*bits == ~(uint64_t)0) == was_full){
+            break;
+        }
+        word /= 64;
+    }
+}
+
+void Database_full_init(struct Connection *conn)
+// build every level from set_bits.  Bits for words past the end of
+// the level below are set, so they look full and are never picked.
+{
+    struct Database *db = conn->db;
+    uint64_t *below = db->set_bits;
+    int level = 0;
+    long i = 0;
+
+    for(level = 0; level < DB_FULL_LEVELS; level++){
+        long below_words = Database_level_words(db, level - 1);
+        long words = Database_level_words(db, level);
+
+        free(db->full_bits[level]);
+        db->full_bits[level] = Stats_calloc(words, sizeof(uint64_t));
+        if(!db->full_bits[level]){
+            die("Memory error", conn);
+        }
+
+        for(i = 0; i < words * 64; i++){
+            if(i >= below_words || below[i] == ~(uint64_t)0){
+                db->full_bits[level][i / 64] |= (uint64_t)1 << (i % 64);
+            }
+        }
+        below = db->full_bits[level];
+    }
+}
+
+int Database_free_id(struct Database *db)
+// the lowest row that isn't set, or max_rows if there is none;
+// set_bits and full_bits must be loaded
+{
+    int level = DB_FULL_LEVELS - 1;
+    long words = Database_level_words(db, level);
+    long word = 0;
+
+    // the top level is one word per 16M rows, short enough to look through
+    while(word < words && db->full_bits[level][word] == ~(uint64_t)0){
+        word++;
+    }
+    if(word == words){
+        return db->max_rows;
+    }
+
+    // each level down, the first word that isn't full
+    for(; level >= 0; level--){
+        word = word * 64 + __builtin_ctzll(~db->full_bits[level][word]);
+    }
+
+    // the last word's bits past max_rows are free but don't exist
+    long id = word * 64 + __builtin_ctzll(~db->set_bits[word]);
+    return id < db->max_rows ? id : db->max_rows;
+}
+
+void Database_flag(struct Database *db, struct Address *addr, int set)
+{
+    // every change to a row's set flag goes through here to keep the bitmaps in step
+    uint64_t bit = (uint64_t)1 << (addr->id % 64);
+    long word = addr->id / 64;
+
+    addr->set = set;
+    if(db->set_bits){
+        int was_full = db->set_bits[word] == ~(uint64_t)0;
+
+        if(set){
+            db->set_bits[word] |= bit;
+        } else {
+            db->set_bits[word] &= ~bit;
+        }
+        if(db->full_bits[0] && (db->set_bits[word] == ~(uint64_t)0) != was_full){
+            Database_mark_full(db, word, !was_full);
+        }
+    }
+}
+
+void Database_grow(struct Connection *conn, int id)
+// make room for row id in RAM.  max_rows at least doubles, so a run
+// of inserts past the end costs O(1) each; the file catches up on
+// the next write.
+{
+    struct Database *db = conn->db;
+    long rows = (long)db->max_rows * 2;
+
+    if(rows <= id){
+        rows = (long)id + 1;
+    }
+    if(rows > INT_MAX){
+        rows = INT_MAX;
+    }
+    if(id >= rows){
+        die("Database is full", conn);
+    }
+
+    struct Address *more = Stats_realloc(db->rows, rows * sizeof(struct Address));
+    if(!more){
+        die("Memory error", conn);
+    }
+    memset(more + db->max_rows, 0, (rows - db->max_rows) * sizeof(struct Address));
+    db->rows = more;
+
+    if(db->set_bits){
+        long old_size = Database_bits_size(db->max_rows);
+        long size = Database_bits_size(rows);
+        uint64_t *bits = Stats_realloc(db->set_bits, size);
+        if(!bits){
+            die("Memory error", conn);
+        }
+        memset((char *)bits + old_size, 0, size - old_size);
+        db->set_bits = bits;
+    }
+
+    db->max_rows = rows;
+    if(db->set_bits){
+        Database_full_init(conn);
+    }
+}
+
+int Database_next_set(struct Database *db, int id)
+// the first set row at or after id, or max_rows; set_bits must be loaded
+{
+    long word = id / 64;
+    long words = ((long)db->max_rows + 63) / 64;
+    uint64_t bits = 0;
+
+    if(id >= db->max_rows){
+        return db->max_rows;
+    }
+
+    bits = db->set_bits[word] & (~(uint64_t)0 << (id % 64));
+    while(!bits){
+        if(++word == words){
+            return db->max_rows;
+        }
+        bits = db->set_bits[word];
+    }
+
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+long Database_set_count(struct Database *db)
+{
+    // how many rows are set; set_bits must be loaded
+    long words = ((long)db->max_rows + 63) / 64;
+    long count = 0;
+    long i = 0;
+
+    for(i = 0; i < words; i++){
+        count += __builtin_popcountll(db->set_bits[i]);
+    }
+
+    return count;
+}
+
+long Database_record_size(struct Address *addr)
+{
+    // a record is the id, name length and email length, then the strings and a crc
+    return 3 * sizeof(int) + strlen(addr->name) + strlen(addr->email) + sizeof(uint32_t);
+}
+
+long Database_record_max(struct Database *db)
+{
+    // big enough for any record, of any version
+    return 3 * sizeof(int) + 2 * (long)db->max_data + sizeof(uint32_t);
+}
+
+void Database_put_record(struct Connection *conn, struct Writer *w, int id,
+        const char *name, int name_len, const char *email, int email_len)
+{
+    // the record Database_parse_record reads back, into w
+    int head[3] = {id, name_len, email_len};
+    uint32_t crc = Crc32_compute(head, sizeof(head));
+
+    crc = Crc32_update(crc, name, name_len);
+    crc = Crc32_update(crc, email, email_len);
+    Writer_put(conn, w, head, sizeof(head));
+    Writer_put(conn, w, name, name_len);
+    Writer_put(conn, w, email, email_len);
+    Writer_put(conn, w, &crc, sizeof(crc));
+}
+
+void Packer_flush(struct Connection *conn, struct Packer *p)
+// compress the records gathered so far into one block at the end of
+// p->records (kept as they are if they don't get smaller) and point
+// their table entries at it, as minus its offset
+{
+    struct BlockHead head = {0};
+
+    if(p->count == 0){
+        return;
+    }
+
+    int64_t at = p->records->offset + p->records->len;
+    long size = Lz_compress(p->raw, p->len, p->packed, p->len - 1);
+    const char *packed = size < 0 ? p->raw : p->packed;
+
+    head.raw_size = p->len;
+    head.packed_size = size < 0 ? p->len : size;
+    head.crc = Crc32_update(Crc32_compute(&head, offsetof(struct BlockHead, crc)), packed, head.packed_size);
+    Writer_put(conn, p->records, &head, sizeof(head));
+    Writer_put(conn, p->records, packed, head.packed_size);
+
+    for(int i = 0; i < p->count; i++){
+        *p->waiting[i] = -at;
+    }
+    p->len = 0;
+    p->count = 0;
+}
+
+void Packer_add(struct Connection *conn, struct Packer *p, int64_t *entry, int id,
+        const char *name, int name_len, const char *email, int email_len)
+// a record for the block being gathered, starting a new block if
+// it won't fit; *entry is set once the block is written.  A record
+// too big for any block is written out on its own at once.
+{
+    long size = 3 * sizeof(int) + (long)name_len + email_len + sizeof(uint32_t);
+    struct Writer w = { .offset = -1, .buf = p->raw + p->len };
+
+    if(size > DB_BLOCK_SIZE){
+        *entry = p->records->offset + p->records->len;
+        Database_put_record(conn, p->records, id, name, name_len, email, email_len);
+        return;
+    }
+    if(p->len + size > DB_BLOCK_SIZE){
+        Packer_flush(conn, p);
+        w.buf = p->raw;
+    }
+
+    // a Writer over the spare room, which the record is known to fit in
+    Database_put_record(conn, &w, id, name, name_len, email, email_len);
+    p->len += size;
+    p->waiting[p->count++] = entry;
+}
+
+struct Packer *Packer_open(struct Connection *conn, struct Writer *records)
+{
+    struct Packer *p = Stats_malloc(sizeof(struct Packer));
+    if(!p){
+        die("Memory error", conn);
+    }
+    p->records = records;
+    p->len = 0;
+    p->count = 0;
+
+    return p;
+}
+
+void Packer_close(struct Connection *conn, struct Packer *p)
+{
+    Packer_flush(conn, p);
+    free(p);
+}
+
+long Block_record(int fd, int64_t at, int id, struct Block *block, char **rec)
+// points rec at row id's record in the block at file offset at,
+// inflating the block first unless it is the one already in block.
+// Returns the bytes from rec to the end of the block, -1 if it can't
+// be read or -2 if the block fails its crc.
+{
+    struct BlockHead head = {0};
+    int fields[3] = {0};
+
+    if(block->at != at){
+        if(!block->raw){
+            block->raw = Stats_malloc(DB_BLOCK_SIZE);
+            block->packed = Stats_malloc(DB_BLOCK_SIZE);
+            if(!block->raw || !block->packed){
+                return -1;
+            }
+        }
+        block->at = 0;
+
+        if(Stats_read(pread(fd, &head, sizeof(head), at)) != sizeof(head)
+                || head.raw_size > DB_BLOCK_SIZE || head.packed_size > head.raw_size){
+            return -1;
+        }
+        if(Stats_read(pread(fd, block->packed, head.packed_size, at + sizeof(head))) != head.packed_size){
+            return -1;
+        }
+        uint32_t crc = Crc32_compute(&head, offsetof(struct BlockHead, crc));
+        if(Crc32_update(crc, block->packed, head.packed_size) != head.crc){
+            return -2;
+        }
+        if(head.packed_size == head.raw_size){
+            memcpy(block->raw, block->packed, head.raw_size);
+        } else if(Lz_decompress(block->packed, head.packed_size, block->raw, DB_BLOCK_SIZE) != head.raw_size){
+            return -1;
+        }
+
+        block->at = at;
+        block->size = head.raw_size;
+        block->packed_size = head.packed_size;
+        block->next = 0;
+    }
+
+    // a block is a run of whole records, walk them to the row's.  Rows
+    // are mostly asked for in id order, so start after the last one
+    // found and only go back to the start if it isn't there.
+    for(long start = block->next, pos = start, end = block->size; ; ){
+        if(pos + (long)sizeof(fields) > end){
+            if(start == 0){
+                return -1;
+            }
+            end = start;
+            start = pos = 0;
+            continue;
+        }
+        memcpy(fields, block->raw + pos, sizeof(fields));
+        if(fields[1] < 0 || fields[2] < 0){
+            return -1;
+        }
+        long size = sizeof(fields) + (long)fields[1] + fields[2] + sizeof(uint32_t);
+        if(fields[0] == id){
+            *rec = block->raw + pos;
+            block->next = pos + size;
+            return block->size - pos;
+        }
+        pos += size;
+    }
+}
+
+char *Arena_copy(struct ArenaBlock **arena, const char *src, int len, int max_data)
+{
+    // an exactly sized, terminated copy, cut to max_data - 1
+    if(len > max_data - 1){
+        len = max_data - 1;
+    }
+
+    char *dest = Arena_alloc(arena, len + 1);
+    if(dest){
+        memcpy(dest, src, len);
+        dest[len] = '\0';
+    }
+
+    return dest;
+}
+
+char *Database_copy_string(struct Connection *conn, const char *src, int len)
+{
+    char *dest = Arena_copy(&conn->db->arena, src, len, conn->db->max_data);
+    if(!dest){
+        die("Memory error", conn);
+    }
+
+    return dest;
+}
+
+void Database_track(struct Connection *conn, struct Address *addr)
+{
+    // remember that this row now lives in RAM
+    struct Database *db = conn->db;
+
+    if(addr->loaded){
+        return;
+    }
+
+    if(db->loaded_count == db->loaded_cap){
+        int cap = db->loaded_cap ? db->loaded_cap * 2 : 64;
+        int *ids = Stats_realloc(db->loaded_ids, cap * sizeof(int));
+        if(!ids){
+            die("Memory error", conn);
+        }
+        db->loaded_ids = ids;
+        db->loaded_cap = cap;
+    }
+
+    db->loaded_ids[db->loaded_count++] = addr->id;
+    addr->loaded = 1;
+}
+
+long Database_parse_record(struct Database *db, int fd, int id, int64_t offset,
+        struct Reader *reader, struct Block *block, char **name_out, char **email_out, int *lens)
+// reads row id's record through reader (Database_record_max bytes), or
+// finds it in block if offset is minus a block's, points name and
+// email at its strings (lens[0] and lens[1] bytes, not terminated)
+// and returns how many bytes it takes up in the file, -1 if it
+// can't be read or -2 if it fails its crc.  Version 3 and later
+// records are id, name length, email length, then the string bytes,
+// and from version 7 a crc of all that; version 2 records are the
+// id and two max_data wide fields.  Touches nothing but reader and
+// block, so threads can call it.
+{
+    long max = Database_record_max(db);
+    char *buf = NULL;
+    int head[3] = {0};
+    char *name = NULL;
+    char *email = NULL;
+    long size = 0;
+    long rc = 0;
+
+    if(offset < 0){
+        rc = Block_record(fd, -offset, id, block, &buf);
+        if(rc < 0){
+            return rc;
+        }
+    } else {
+        // all of it, or up to the end of the file for the last record in it
+        buf = Reader_get(fd, reader, offset, max, &rc);
+        if(!buf){
+            return -1;
+        }
+    }
+
+    if(db->version < 3){
+        size = sizeof(int) + 2 * (long)db->max_data;
+        if(rc < size){
+            return -1;
+        }
+        memcpy(head, buf, sizeof(int));
+        name = buf + sizeof(int);
+        email = name + db->max_data;
+        head[1] = strnlen(name, db->max_data);
+        head[2] = strnlen(email, db->max_data);
+    } else {
+        if(rc < (long)sizeof(head)){
+            return -1;
+        }
+        memcpy(head, buf, sizeof(head));
+        size = sizeof(head) + (long)head[1] + head[2];
+        if(head[1] < 0 || head[2] < 0 || size > rc){
+            return -1;
+        }
+        name = buf + sizeof(head);
+        email = name + head[1];
+
+        if(db->version >= 7){
+            uint32_t crc = 0;
+            if(size + (long)sizeof(crc) > rc){
+                return -1;
+            }
+            memcpy(&crc, buf + size, sizeof(crc));
+            if(crc != Crc32_compute(buf, size)){
+                return -2;
+            }
+            size += sizeof(crc);
+        }
+    }
+
+    if(head[0] != id){
+        return -1;
+    }
+
+    *name_out = name;
+    *email_out = email;
+    lens[0] = head[1];
+    lens[1] = head[2];
+
+    // a packed record's share of its block
+    if(offset < 0){
+        size = size * block->packed_size / block->size;
+    }
+
+    return size;
+}
+
+long Database_read_strings(struct Connection *conn, int id, int64_t offset,
+        char **name_out, char **email_out, int *lens)
+{
+    // Database_parse_record through db->reader
+    struct Database *db = conn->db;
+
+    long size = Database_parse_record(db, fileno(conn->file), id, offset, &db->reader, &db->block,
+            name_out, email_out, lens);
+    if(size < 0){
+        die(size == -2 ? "Record failed its checksum" : "Failed to read record", conn);
+    }
+
+    return size;
+}
+
+long Database_read_record(struct Connection *conn, struct Address *addr, int64_t offset)
+{
+    // reads the row's record into the arena, returns its size in the file
+    char *name = NULL;
+    char *email = NULL;
+    int lens[2] = {0};
+    long size = Database_read_strings(conn, addr->id, offset, &name, &email, lens);
+
+    addr->name = Database_copy_string(conn, name, lens[0]);
+    addr->email = Database_copy_string(conn, email, lens[1]);
+
+    return size;
+}
+
+void Database_fetch_row(struct Connection *conn, int id)
+// read just this row: its table entry, then its record if it has one
+{
+    struct Address *addr = &((struct Address *)conn->db->rows)[id];
+    int64_t table[DB_TABLE_CHUNK];
+    long size = 0;
+    int was = Stats_phase(STATS_LOAD);
+
+    // the whole page, to check its crc
+    const char *error = Database_read_chunk(conn->db, fileno(conn->file), id / DB_TABLE_CHUNK, table, &size);
+    if(error){
+        die(error, conn);
+    }
+    int64_t offset = table[id % DB_TABLE_CHUNK];
+
+    addr->id = id;
+    Database_flag(conn->db, addr, offset != 0);
+    addr->dirty = 0;
+    addr->disk_size = 0;
+    addr->name = NULL;
+    addr->email = NULL;
+    if(addr->set){
+        addr->disk_size = Database_read_record(conn, addr, offset);
+    }
+
+    Database_track(conn, addr);
+    Stats_phase(was);
+}
+
+struct Address *Database_row_unread(struct Connection *conn, int id)
+// the row, tracked in RAM without reading what the file holds for
+// it, for callers that are about to overwrite it anyway
+{
+    struct Address *addr = &((struct Address *)conn->db->rows)[id];
+
+    if(!addr->loaded){
+        addr->id = id;
+        Database_flag(conn->db, addr, 0);
+        addr->name = NULL;
+        addr->email = NULL;
+        addr->disk_size = id < conn->db->disk_rows ? -1 : 0;
+        Database_track(conn, addr);
+    }
+
+    return addr;
+}
+
+
+int Wal_busy(const char *filename)
+{
+    // a writer holds the log's lock, so it is alive and will finish what it started
+    char *path = Stats_malloc(strlen(filename) + 5);
+    int busy = 0;
+
+    if(!path){
+        return 0;
+    }
+    sprintf(path, "%s.wal", filename);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd != -1){
+        busy = flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+        close(fd);
+    }
+    errno = 0;
+
+    return busy;
+}
+
+void Wal_open(struct Connection *conn, const char *filename)
+// writers hold an exclusive lock on the log for as long as the
+// connection is open, so there is only ever one; readers never lock,
+// and never create the log either: without one there is nothing in it
+{
+    char *path = Stats_malloc(strlen(filename) + 5);
+    if(!path){
+        die("Memory error", conn);
+    }
+    sprintf(path, "%s.wal", filename);
+
+    conn->wal = open(path, conn->writer ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY, 0644);
+    free(path);
+    if(conn->wal == -1 && !conn->writer && errno == ENOENT){
+        errno = 0;
+        conn->wal_size = 0;
+        return;
+    }
+    if(conn->wal == -1){
+        die("Failed to open the write-ahead log", conn);
+    }
+
+    if(conn->writer && flock(conn->wal, LOCK_EX) == -1){
+        die("Cannot lock the database", conn);
+    }
+
+    conn->wal_size = lseek(conn->wal, 0, SEEK_END);
+}
+
+int Index_compare(const void *a, const void *b)
+{
+    const struct IndexEntry *x = a;
+    const struct IndexEntry *y = b;
+    int cmp = strcmp(x->key, y->key);
+
+    return cmp ? cmp : x->id - y->id;
+}
+
+long Index_search(struct Database *db, const char *key, int id)
+// position of the first entry of the sorted part not below (key, id)
+{
+    struct IndexEntry target = {key, id, 0};
+    long low = 0;
+    long high = db->index_sorted;
+
+    while(low < high){
+        long mid = low + (high - low) / 2;
+        if(Index_compare(&db->index[mid], &target) < 0){
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+void Index_merge(struct Connection *conn)
+// fold the changes since the last merge into the sorted part: drop
+// the removed entries, sort the added ones and merge them in from the
+// back.  O(rows) once for a whole run of sets and deletes, instead of
+// a memmove of the array for each one.
+{
+    struct Database *db = conn->db;
+    long added = db->index_count - db->index_sorted;
+    long kept = 0;
+    long i = 0;
+
+    if(!db->index || (!added && !db->index_removed)){
+        return;
+    }
+
+    struct IndexEntry *adds = Stats_malloc((added + 1) * sizeof(struct IndexEntry));
+    if(!adds){
+        die("Memory error", conn);
+    }
+    memcpy(adds, db->index + db->index_sorted, added * sizeof(struct IndexEntry));
+    qsort(adds, added, sizeof(struct IndexEntry), Index_compare);
+
+    for(i = 0; i < db->index_sorted; i++){
+        if(!db->index[i].removed){
+            db->index[kept++] = db->index[i];
+        }
+    }
+
+    long to = kept + added;
+    long a = kept - 1;
+    long b = added - 1;
+    while(b >= 0){
+        if(a >= 0 && Index_compare(&db->index[a], &adds[b]) > 0){
+            db->index[--to] = db->index[a--];
+        } else {
+            db->index[--to] = adds[b--];
+        }
+    }
+    free(adds);
+
+    db->index_count = kept + added;
+    db->index_sorted = db->index_count;
+    db->index_removed = 0;
+}
+
+void Index_pending(struct Connection *conn)
+{
+    // merge once the changes held back are a sixteenth of the index
+    struct Database *db = conn->db;
+    long pending = db->index_count - db->index_sorted + db->index_removed;
+
+    if(pending > INDEX_PENDING && pending > db->index_sorted / 16){
+        Index_merge(conn);
+    }
+}
+
+void Index_add(struct Connection *conn, struct Address *addr)
+{
+    // onto the end, for Index_merge to sort in
+    struct Database *db = conn->db;
+    const char *keys[2] = {addr->name, addr->email};
+    int i = 0;
+
+    if(!db->index || !addr->set){
+        return;
+    }
+
+    if(db->index_count + 2 > db->index_cap){
+        long cap = db->index_cap * 2 + 2;
+        struct IndexEntry *bigger = Stats_realloc(db->index, cap * sizeof(struct IndexEntry));
+        if(!bigger){
+            die("Memory error", conn);
+        }
+        db->index = bigger;
+        db->index_cap = cap;
+    }
+
+    for(i = 0; i < 2; i++){
+        db->index[db->index_count].key = keys[i];
+        db->index[db->index_count].id = addr->id;
+        db->index[db->index_count++].removed = 0;
+    }
+    Index_pending(conn);
+}
+
+void Index_remove(struct Connection *conn, struct Address *addr)
+// an entry in the sorted part is only marked, one added since the
+// last merge is taken out of the end (the newest are looked at first)
+{
+    struct Database *db = conn->db;
+    const char *keys[2] = {addr->name, addr->email};
+    int i = 0;
+
+    if(!db->index || !addr->set){
+        return;
+    }
+
+    for(i = 0; i < 2; i++){
+        // a name that is the same as the email is there twice
+        long pos = Index_search(db, keys[i], addr->id);
+        while(pos < db->index_sorted && db->index[pos].removed && db->index[pos].id == addr->id
+                && strcmp(db->index[pos].key, keys[i]) == 0){
+            pos++;
+        }
+        if(pos < db->index_sorted && db->index[pos].id == addr->id && strcmp(db->index[pos].key, keys[i]) == 0){
+            db->index[pos].removed = 1;
+            db->index_removed++;
+            continue;
+        }
+        for(pos = db->index_count - 1; pos >= db->index_sorted; pos--){
+            if(db->index[pos].id == addr->id && strcmp(db->index[pos].key, keys[i]) == 0){
+                db->index[pos] = db->index[--db->index_count];
+                break;
+            }
+        }
+    }
+    Index_pending(conn);
+}
+
+void Database_apply(struct Connection *conn, int op, int id, const char *name, int name_len,
+        const char *email, int email_len)
+// replaying is unconditional (no "Already set" check) so that applying
+// the same record twice leaves the row exactly as applying it once
+{
+    if(id >= conn->db->max_rows){
+        Database_grow(conn, id);
+    }
+
+    struct Address *addr = Database_row_unread(conn, id);
+
+    Index_remove(conn, addr);
+    addr->name = NULL;
+    addr->email = NULL;
+    Database_flag(conn->db, addr, 0);
+    addr->dirty = 1;
+
+    if(op == 's'){
+        Database_flag(conn->db, addr, 1);
+        addr->name = Database_copy_string(conn, name, name_len);
+        addr->email = Database_copy_string(conn, email, email_len);
+        Index_add(conn, addr);
+    }
+}
+
+long Wal_record(const char *log, long pos, long size, int *head)
+{
+    // the length of the whole record at pos, head and crc included, 0
+    // if it is cut short or fails its crc (the end of the good log)
+    uint32_t crc = 0;
+
+    if(pos + 4 * (long)sizeof(int) > size){
+        return 0;
+    }
+    memcpy(head, log + pos, 4 * sizeof(int));
+    if(head[2] < 0 || head[3] < 0){
+        return 0;
+    }
+
+    long len = 4 * sizeof(int) + (long)head[2] + head[3];
+    if(pos + len + (long)sizeof(crc) > size){
+        return 0;
+    }
+    memcpy(&crc, log + pos + len, sizeof(crc));
+    if(crc != Crc32_compute(log + pos, len)){
+        return 0;
+    }
+
+    return len + sizeof(crc);
+}
+
+char *Wal_read(struct Connection *conn)
+{
+    // the whole log; for a reader it may be shorter than it was a moment ago
+    char *log = Stats_malloc(conn->wal_size);
+    if(!log){
+        die("Memory error", conn);
+    }
+    long rc = Stats_read(pread(conn->wal, log, conn->wal_size, 0));
+    if(rc == -1 || (rc != conn->wal_size && conn->writer)){
+        free(log);
+        die("Failed to read the write-ahead log", conn);
+    }
+    // a checkpoint emptied the log under a reader, which will start over
+    conn->wal_size = rc;
+
+    return log;
+}
+
+void Database_put_page(struct Connection *conn, int64_t at, const void *data, int len)
+{
+#ifdef EX17_TEAR
+    // test builds only: EX17_TEAR=n writes half of the nth page and
+    // dies, the way a crash part way through a checkpoint would
+    static long puts = 0;
+    char *env = getenv("EX17_TEAR");
+    if(env && ++puts == atol(env)){
+        Stats_write(pwrite(fileno(conn->file), data, len / 2, at));
+        _exit(3);
+    }
+#endif
+    if(Stats_write(pwrite(fileno(conn->file), data, len, at)) != len){
+        die("Failed to write database", conn);
+    }
+}
+
+void Wal_redo(struct Connection *conn)
+// a checkpoint logs every write it makes in place as a p record and
+// closes them with a P before it starts on them.  If a writer finds a
+// closed set, the checkpoint died part way through it, so the whole
+// set is written again before the header (the last of them) is read.
+// One without its P was never started on.
+{
+    int head[4];
+    long first = -1;
+    long pos = 0;
+    long len = 0;
+
+    if(conn->wal_size == 0 || !conn->writer){
+        return;
+    }
+
+    char *log = Wal_read(conn);
+    while((len = Wal_record(log, pos, conn->wal_size, head)) > 0){
+        if(head[0] == 'p' && first == -1){
+            first = pos;
+        } else if(head[0] == 'P' && first != -1){
+            for(long at = first, step = 0; at < pos; at += step){
+                int64_t where = 0;
+                step = Wal_record(log, at, pos, head);
+                if(head[2] != sizeof(where)){
+                    free(log);
+                    die("Corrupt write-ahead log", conn);
+                }
+                memcpy(&where, log + at + sizeof(head), sizeof(where));
+                Database_put_page(conn, where, log + at + sizeof(head) + sizeof(where), head[3]);
+            }
+            conn->wal_pages = 1;
+            first = -1;
+        } else if(head[0] != 'p'){
+            first = -1;
+        }
+        pos += len;
+    }
+
+    free(log);
+}
+
+void Wal_replay(struct Connection *conn)
+// S and D records only count once the C record that commits them is
+// there too, so a commit that was cut short leaves none of its
+// records behind; s and d are from before there were commits, and
+// stand on their own.  p and P are Wal_redo's.
+{
+    int head[4];    // op, id, name_len, email_len
+    long committed = 0;
+    long pos = 0;
+    long len = 0;
+
+    if(conn->wal_size == 0){
+        return;
+    }
+
+    char *log = Wal_read(conn);
+    while((len = Wal_record(log, pos, conn->wal_size, head)) > 0){
+        if(!strchr("sdSDCpP", head[0]) || head[1] < 0){
+            free(log);
+            die("Corrupt write-ahead log", conn);
+        }
+        pos += len;
+        if(strchr("sdCP", head[0])){
+            committed = pos;
+        }
+    }
+
+    for(pos = 0; pos < committed; pos += len){
+        len = Wal_record(log, pos, committed, head);
+        if(strchr("sdSD", head[0])){
+            char *name = log + pos + sizeof(head);
+            Database_apply(conn, strchr("sS", head[0]) ? 's' : 'd', head[1], name, head[2], name + head[2], head[3]);
+        }
+    }
+
+    free(log);
+
+    // anything after the last commit is a write that never finished,
+    // or for a reader one that is still going on
+    if(committed < conn->wal_size && conn->writer){
+        if(ftruncate(conn->wal, committed) == -1){
+            die("Cannot truncate the write-ahead log", conn);
+        }
+        conn->wal_size = committed;
+    }
+}
+
+void Wal_flush(struct Connection *conn)
+{
+    if(conn->wal_len == 0){
+        return;
+    }
+
+    if(Stats_write(write(conn->wal, conn->wal_buf, conn->wal_len)) != conn->wal_len){
+        die("Failed to write the write-ahead log", conn);
+    }
+
+    conn->wal_size += conn->wal_len;
+    conn->wal_len = 0;
+    conn->wal_unsynced = 1;
+}
+
+void Wal_put(struct Connection *conn, int op, int id, const void *name, int name_len,
+        const void *email, int email_len)
+// one record into the log buffer; it only reaches the disk when
+// Wal_commit (or a full buffer) flushes it
+{
+    int head[4] = {op, id, name_len, email_len};
+    long len = sizeof(head) + head[2] + head[3];
+    uint32_t crc = 0;
+
+    if(conn->wal_len + len + (long)sizeof(crc) > conn->wal_cap){
+        long cap = conn->wal_cap ? conn->wal_cap : 4096;
+        while(cap < conn->wal_len + len + (long)sizeof(crc)){
+            cap *= 2;
+        }
+        char *buf = Stats_realloc(conn->wal_buf, cap);
+        if(!buf){
+            die("Memory error", conn);
+        }
+        conn->wal_buf = buf;
+        conn->wal_cap = cap;
+    }
+
+    char *rec = conn->wal_buf + conn->wal_len;
+    memcpy(rec, head, sizeof(head));
+    memcpy(rec + sizeof(head), name, name_len);
+    memcpy(rec + sizeof(head) + name_len, email, email_len);
+    crc = Crc32_compute(rec, len);
+    memcpy(rec + len, &crc, sizeof(crc));
+    conn->wal_len += len + sizeof(crc);
+
+    if(conn->wal_len >= WAL_GROUP_BYTES && !conn->wal_hold){
+        Wal_flush(conn);
+    }
+}
+
+void Wal_append(struct Connection *conn, int op, int id)
+{
+    // log the row's current state (op is s or d), to count from the next Wal_commit
+    struct Address *addr = &((struct Address *)conn->db->rows)[id];
+
+    if(op == 's'){
+        Wal_put(conn, 'S', id, addr->name, strlen(addr->name), addr->email, strlen(addr->email));
+    } else {
+        Wal_put(conn, 'D', id, "", 0, "", 0);
+    }
+    conn->wal_uncommitted = 1;
+}
+
+void Wal_log_staged(struct Connection *conn)
+// what Database_stage held goes into the log as p records and a P,
+// and onto the disk, before Database_put_staged makes any of it, so
+// a crash part way through leaves Wal_redo all it needs to finish
+{
+    int64_t at = 0;
+    int len = 0;
+    long pos = 0;
+
+    // the records and table they point at were appended, not logged
+    if(Stats_sync(fsync(fileno(conn->file))) == -1){
+        die("Cannot sync database", conn);
+    }
+
+    for(pos = 0; pos < conn->staged_len; pos += sizeof(at) + sizeof(len) + len){
+        memcpy(&at, conn->staged + pos, sizeof(at));
+        memcpy(&len, conn->staged + pos + sizeof(at), sizeof(len));
+        Wal_put(conn, 'p', 0, &at, sizeof(at), conn->staged + pos + sizeof(at) + sizeof(len), len);
+    }
+    Wal_put(conn, 'P', 0, "", 0, "", 0);
+    Wal_flush(conn);
+    if(Stats_sync(fsync(conn->wal)) == -1){
+        die("Cannot sync the write-ahead log", conn);
+    }
+    conn->wal_unsynced = 0;
+}
+
+void Database_put_staged(struct Connection *conn)
+{
+    // the writes Wal_log_staged has made safe, in the order they were staged
+    int64_t at = 0;
+    int len = 0;
+    long pos = 0;
+
+    for(pos = 0; pos < conn->staged_len; pos += sizeof(at) + sizeof(len) + len){
+        memcpy(&at, conn->staged + pos, sizeof(at));
+        memcpy(&len, conn->staged + pos + sizeof(at), sizeof(len));
+        Database_put_page(conn, at, conn->staged + pos + sizeof(at) + sizeof(len), len);
+    }
+    conn->staged_len = 0;
+}
+
+void Database_load_legacy(struct Connection *conn)
+// version 1 files have no row table, so the only way to find a row
+// is to read every row in front of it.  They are parsed out of a
+// Reader's buffer, which reads big pieces of the file at a time.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    struct Reader reader = {.cap = READER_SIZE};
+    int64_t at = 2 * sizeof(int);
+    long fields = 2 * (long)db->max_data;
+    long got = 0;
+    int i = 0;
+
+    // rows past disk_rows were added by the log, the file has none
+    for(i = 0; i < db->disk_rows; i++){
+        struct Address *addr = &((struct Address *)db->rows)[i];
+        char *name = NULL;
+        char *email = NULL;
+        int head[2] = {0};
+
+        // id and set, then name and email if it is set
+        char *buf = Reader_get(fd, &reader, at, sizeof(head), &got);
+        if(!buf || got < (long)sizeof(head)){
+            Reader_close(&reader);
+            die("Failed to read row", conn);
+        }
+        memcpy(head, buf, sizeof(head));
+        at += sizeof(head);
+        if(head[1]){
+            name = Reader_get(fd, &reader, at, fields, &got);
+            if(!name || got < fields){
+                Reader_close(&reader);
+                die("Failed to read row", conn);
+            }
+            email = name + db->max_data;
+            at += fields;
+        }
+
+        // the log already holds a newer version of this row
+        if(addr->loaded){
+            continue;
+        }
+
+        addr->id = head[0];
+        Database_flag(db, addr, head[1]);
+        addr->name = NULL;
+        addr->email = NULL;
+        if(head[1]){
+            addr->name = Database_copy_string(conn, name, strnlen(name, db->max_data));
+            addr->email = Database_copy_string(conn, email, strnlen(email, db->max_data));
+        }
+        addr->dirty = 0;
+        addr->disk_size = 0;
+        Database_track(conn, addr);
+    }
+
+    Reader_close(&reader);
+}
+
+void Database_load_bits(struct Connection *conn)
+// fill in set_bits: version 4 files have them on disk, older ones
+// only have the table to work them out from.  Rows already in RAM
+// may have changed since, so their flags win.
+{
+    struct Database *db = conn->db;
+    long size = Database_bits_size(db->disk_rows);
+    int i = 0;
+
+    if(db->set_bits){
+        return;
+    }
+    int was = Stats_phase(STATS_LOAD);
+    if(db->version < 2 && !db->all_loaded){
+        Database_load_legacy(conn);
+        db->all_loaded = 1;
+    }
+
+    db->set_bits = Stats_calloc(1, Database_bits_size(db->max_rows));
+    if(!db->set_bits){
+        die("Memory error", conn);
+    }
+
+    if(db->all_loaded || db->version < 2){
+        // nothing on disk is news any more
+    } else if(db->version >= 7){
+        // a page at a time, checking each one's crc
+        uint64_t page[DB_PAGE_SIZE / sizeof(uint64_t)];
+        uint32_t sum = 0;
+        for(long at = 0; at < size; at += DB_PAGE_SIZE){
+            if(Stats_read(pread(fileno(conn->file), page, DB_PAGE_SIZE, db->table + at)) != DB_PAGE_SIZE
+                    || Stats_read(pread(fileno(conn->file), &sum, sizeof(sum), Database_sum_offset(db, at / DB_PAGE_SIZE))) != sizeof(sum)){
+                die("Failed to read the set bitmap", conn);
+            }
+            if(sum != Crc32_compute(page, DB_PAGE_SIZE)){
+                die("Set bitmap page failed its checksum", conn);
+            }
+            memcpy((char *)db->set_bits + at, page, size - at < DB_PAGE_SIZE ? size - at : DB_PAGE_SIZE);
+        }
+    } else if(db->version >= 4){
+        if(Stats_read(pread(fileno(conn->file), db->set_bits, size, db->table)) != size){
+            die("Failed to read the set bitmap", conn);
+        }
+    } else {
+        int64_t *table = Stats_malloc((db->disk_rows + 1) * sizeof(int64_t));
+        if(!table){
+            die("Memory error", conn);
+        }
+
+        long table_size = db->disk_rows * sizeof(int64_t);
+        if(Stats_read(pread(fileno(conn->file), table, table_size, Database_entry_offset(db, 0))) != table_size){
+            free(table);
+            die("Failed to read row table", conn);
+        }
+        for(i = 0; i < db->disk_rows; i++){
+            if(table[i]){
+                db->set_bits[i / 64] |= (uint64_t)1 << (i % 64);
+            }
+        }
+        free(table);
+    }
+
+    for(i = 0; i < db->loaded_count; i++){
+        struct Address *addr = &((struct Address *)db->rows)[db->loaded_ids[i]];
+        Database_flag(db, addr, addr->set);
+    }
+
+    Database_full_init(conn);
+    Stats_phase(was);
+}
+
+int Scan_threads(struct Database *db)
+{
+    // a thread per core (or EX17_THREADS), as long as each gets a fair share of rows
+    char *env = getenv("EX17_THREADS");
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    long most = db->max_rows / SCAN_PART_ROWS;
+
+    if(threads > most){
+        threads = most;
+    }
+    if(threads > SCAN_MAX_THREADS){
+        threads = SCAN_MAX_THREADS;
+    }
+
+    return threads < 1 ? 1 : threads;
+}
+
+const char *Scan_parallel(struct Connection *conn, struct ScanPart *parts, int count, void *(*work)(void *))
+// split the rows into count runs of whole table chunks, one per part,
+// and run work on each, all at once.  The main thread takes part 0.
+// Returns the first part's error, if any.
+{
+    pthread_t threads[SCAN_MAX_THREADS];
+    int started[SCAN_MAX_THREADS] = {0};
+    long chunks = ((long)conn->db->max_rows + DB_TABLE_CHUNK - 1) / DB_TABLE_CHUNK;
+    int i = 0;
+
+    for(i = 0; i < count; i++){
+        parts[i].conn = conn;
+        parts[i].start = chunks * i / count * DB_TABLE_CHUNK;
+        parts[i].end = chunks * (i + 1) / count * DB_TABLE_CHUNK;
+        if(parts[i].end > conn->db->max_rows){
+            parts[i].end = conn->db->max_rows;
+        }
+        parts[i].error = NULL;
+    }
+
+    // a part that can't get a thread just runs here afterwards
+    for(i = 1; i < count; i++){
+        started[i] = pthread_create(&threads[i], NULL, work, &parts[i]) == 0;
+    }
+    work(&parts[0]);
+    for(i = 1; i < count; i++){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
+        } else {
+            work(&parts[i]);
+        }
+    }
+
+    for(i = 0; i < count; i++){
+        if(parts[i].error){
+            return parts[i].error;
+        }
+    }
+
+    return NULL;
+}
+
+void *Database_load_part(void *arg)
+// the threaded half of Database_load: read the records of this part's
+// set rows that aren't in RAM into the part's own arena.  Only the
+// part's own rows are written to, and no table chunk is shared.
+{
+    struct ScanPart *part = arg;
+    struct Database *db = part->conn->db;
+    int fd = fileno(part->conn->file);
+    int64_t table[DB_TABLE_CHUNK];
+    int chunk = -1;
+    int i = 0;
+
+    part->reader.cap = READER_SIZE;
+
+    for(i = Database_next_set(db, part->start); i < part->end; i = Database_next_set(db, i + 1)){
+        struct Address *addr = &((struct Address *)db->rows)[i];
+        char *name = NULL;
+        char *email = NULL;
+        int lens[2] = {0};
+
+        if(addr->loaded){
+            continue;
+        }
+
+        if(i / DB_TABLE_CHUNK != chunk){
+            long size = 0;
+            chunk = i / DB_TABLE_CHUNK;
+            part->error = Database_read_chunk(db, fd, chunk, table, &size);
+            if(part->error){
+                break;
+            }
+        }
+
+        long size = Database_parse_record(db, fd, i, table[i % DB_TABLE_CHUNK], &part->reader, &part->block,
+                &name, &email, lens);
+        if(size < 0){
+            part->error = size == -2 ? "Record failed its checksum" : "Failed to read record";
+            break;
+        }
+        addr->name = Arena_copy(&part->arena, name, lens[0], db->max_data);
+        addr->email = Arena_copy(&part->arena, email, lens[1], db->max_data);
+        if(!addr->name || !addr->email){
+            part->error = "Memory error";
+            break;
+        }
+        addr->disk_size = size;
+    }
+
+    Reader_close(&part->reader);
+    Block_free(&part->block);
+
+    return NULL;
+}
+
+void Database_load(struct Connection *conn)
+// bring every set row that isn't in RAM yet into RAM.  Rows that
+// aren't set are left alone, the bitmap already says all there is.
+// The reading is split across Scan_threads threads; the bookkeeping
+// that isn't safe to share is done here afterwards, in id order.
+{
+    struct Database *db = conn->db;
+    struct ScanPart parts[SCAN_MAX_THREADS];
+    int count = 0;
+    int i = 0;
+
+    if(db->all_loaded){
+        return;
+    }
+    int was = Stats_phase(STATS_LOAD);
+    if(db->version < 2){
+        Database_load_legacy(conn);
+        db->all_loaded = 1;
+        Database_load_bits(conn);
+        Stats_phase(was);
+        return;
+    }
+
+    Database_load_bits(conn);
+
+    count = Scan_threads(db);
+    memset(parts, 0, count * sizeof(struct ScanPart));
+    const char *error = Scan_parallel(conn, parts, count, Database_load_part);
+
+    // the strings belong to the database from now on, even after an error
+    for(i = 0; i < count; i++){
+        struct ArenaBlock *last = parts[i].arena;
+        if(last){
+            while(last->next){
+                last = last->next;
+            }
+            last->next = db->arena;
+            db->arena = parts[i].arena;
+        }
+    }
+    if(error){
+        die(error, conn);
+    }
+
+    for(i = Database_next_set(db, 0); i < db->max_rows; i = Database_next_set(db, i + 1)){
+        struct Address *addr = &((struct Address *)db->rows)[i];
+        if(addr->loaded){
+            continue;
+        }
+
+        addr->id = i;
+        Database_flag(db, addr, 1);
+        addr->dirty = 0;
+        Database_track(conn, addr);
+    }
+
+    db->all_loaded = 1;
+    Stats_phase(was);
+}
+
+struct Address *Database_row(struct Connection *conn, int id)
+{
+    // the row, read from the file first if it isn't in RAM yet
+    struct Address *addr = &((struct Address *)conn->db->rows)[id];
+
+    if(!addr->loaded){
+        if(id >= conn->db->disk_rows){
+            // grown since the file was written, so there is nothing to read
+            Database_row_unread(conn, id);
+        } else if(conn->db->version < 2){
+            Database_load(conn);
+        } else {
+            Database_fetch_row(conn, id);
+        }
+    }
+
+    return addr;
+}
+
+void Database_pack_header(struct Connection *conn, char *slot)
+{
+    // the header as it is now, as it goes in either slot
+    struct Header head = {
+        .magic = DB_MAGIC,
+        .version = DB_VERSION,
+        .max_data = conn->db->max_data,
+        .max_rows = conn->db->disk_rows,
+        .garbage = conn->db->garbage,
+        .table = conn->db->table,
+        .generation = conn->db->generation,
+        .flags = conn->db->flags,
+        .hash = conn->db->hash,
+        .hash_buckets = conn->db->hash_buckets
+    };
+    head.crc = Header_crc(&head);
+    memset(slot, 0, DB_HEADER_SLOT);
+    memcpy(slot, &head, sizeof(head));
+}
+
+void Database_write_header(struct Connection *conn)
+// into the slot that doesn't hold the newest header, so if this
+// write is cut short that one is still there
+{
+    char slot[DB_HEADER_SLOT];
+
+    Database_pack_header(conn, slot);
+    conn->db->header_slot = !conn->db->header_slot;
+    if(Stats_write(pwrite(fileno(conn->file), slot, sizeof(slot), conn->db->header_slot * DB_HEADER_SLOT)) != sizeof(slot)){
+        die("Failed to write database header", conn);
+    }
+}
+
+struct Connection *Database_open(const char *filename, char mode, int max_data, int max_rows)
+{
+    int was = Stats_phase(STATS_OPEN);
+    struct Connection *conn = Stats_malloc(sizeof(struct Connection));
+    if(!conn){
+        die("Memory error", conn);
+    }
+    conn->wal = -1;
+    conn->wal_buf = NULL;
+    conn->wal_len = 0;
+    conn->wal_cap = 0;
+    conn->wal_unsynced = 0;
+    conn->wal_uncommitted = 0;
+    conn->wal_pages = 0;
+    conn->staged = NULL;
+    conn->staged_len = 0;
+    conn->staged_cap = 0;
+    conn->wal_hold = 0;
+    conn->out = stdout;
+    conn->recover = NULL;
+    conn->file = NULL;
+    conn->db = NULL;
+    conn->print.buf = NULL;
+    conn->format = 't';
+    conn->writer = !strchr("glfnxte", mode);
+
+    conn->path = Stats_malloc(strlen(filename) + 1);
+    conn->db = Stats_calloc(1, sizeof(struct Database));
+    if(!conn->path || !conn->db){
+        die("Failed to allocate database memory", conn);
+    }
+    strcpy(conn->path, filename);
+
+    // set the conn->file pointer
+    // set the conn->db->max_data and conn->db->max_rows values
+    // conn->db->rows is a void pointer to a block of memory that will hold max_rows Addresses,
+    // calloc'd so that rows nobody asks for never get touched
+    Crc32_init();
+    if(mode == 'c'){
+        // left as it is: Database_rewrite builds the new file beside
+        // it and renames it into place, so until then readers still
+        // have the old one
+        int fd = open(filename, O_RDWR | O_CREAT, 0644);
+        conn->file = fd == -1 ? NULL : fdopen(fd, "r+");
+    } else {
+        conn->file = fopen(filename, conn->writer ? "r+" : "r");
+    }
+    if(!conn->file){
+        die("Failed to open the file", conn);
+    }
+
+    // a writer only looks at the file once it has the lock, so it
+    // never sees another writer's half finished checkpoint
+    Wal_open(conn, filename);
+
+    if(mode == 'c'){
+        conn->db->max_data = max_data;
+        conn->db->max_rows = max_rows;
+        conn->db->disk_rows = max_rows;
+        conn->db->table = 2 * DB_HEADER_SLOT;
+        conn->db->version = DB_VERSION;
+        conn->db->rewrite = 1;
+    } else {
+        Wal_redo(conn);
+        Database_read_header(conn);
+    }
+
+    conn->db->rows = Stats_calloc(conn->db->max_rows, sizeof(struct Address));
+    if(!conn->db->rows){
+        die("Failed to allocate database memory", conn);
+    }
+
+    // a log c finds belongs to the file it replaces, and has to stay
+    // until Database_rewrite has renamed the new one in
+    if(mode != 'c'){
+        Wal_replay(conn);
+    }
+    Stats_phase(was);
+
+    return conn;
+}
+
+uint32_t Hash_key(int field, const char *key, long len)
+{
+    // field is DB_HASH_EMAIL or DB_HASH_NAME, so a name and an email that are the same string hash apart
+    return Crc32_update(Crc32_compute(&field, sizeof(field)), key, len);
+}
+
+int Hash_field(struct Connection *conn, const char *name)
+{
+    // the DB_HASH_* flags e and h are asked for
+    if(strcmp(name, "email") == 0){
+        return DB_HASH_EMAIL;
+    }
+    if(strcmp(name, "name") == 0){
+        return DB_HASH_NAME;
+    }
+    if(strcmp(name, "both") == 0){
+        return DB_HASH_KEYS;
+    }
+    if(strcmp(name, "none") == 0){
+        return 0;
+    }
+
+    die("Unknown key, only: email, name, both, none", conn);
+    return 0;
+}
+
+int Hash_row(int flags, int id, const char *name, int name_len, const char *email, int email_len,
+        struct HashEntry *keys)
+{
+    // the index entries a row with these strings has, into keys, and how many
+    int count = 0;
+
+    if(flags & DB_HASH_EMAIL){
+        keys[count].hash = Hash_key(DB_HASH_EMAIL, email, email_len);
+        keys[count++].id = id;
+    }
+    if(flags & DB_HASH_NAME){
+        keys[count].hash = Hash_key(DB_HASH_NAME, name, name_len);
+        keys[count++].id = id;
+    }
+
+    return count;
+}
+
+void Hash_seal(struct HashPage *page)
+{
+    page->crc = Crc32_compute((char *)page + sizeof(page->crc), sizeof(*page) - sizeof(page->crc));
+}
+
+const char *Hash_read_page(int fd, int64_t at, struct HashPage *page)
+{
+    // one bucket page, checked like the table's
+    uint32_t crc = 0;
+
+    if(Stats_read(pread(fd, page, sizeof(*page), at)) != sizeof(*page)){
+        return "Failed to read hash index";
+    }
+    crc = page->crc;
+    Hash_seal(page);
+    if(page->crc != crc){
+        return "Hash index failed its checksum";
+    }
+    if(page->count < 0 || page->count > HASH_PAGE_ENTRIES){
+        return "Hash index is broken";
+    }
+
+    return NULL;
+}
+
+int Hash_spill(struct Connection *conn, struct Writer *w)
+// an unlinked file beside the database for the keys of an index
+// being built, so they never have to be held all at once; w writes
+// to it, and the descriptor is for Hash_write to read it back
+{
+    char *path = Stats_malloc(strlen(conn->path) + 6);
+    if(!path){
+        die("Memory error", conn);
+    }
+    sprintf(path, "%s.keys", conn->path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd != -1){
+        unlink(path);
+    }
+    free(path);
+    if(fd == -1){
+        die("Failed to create the hash index's key file", conn);
+    }
+    Writer_open(conn, w, fd, 0);
+
+    return fd;
+}
+
+void Hash_put_pages(struct Connection *conn, int fd, struct HashPage *pages, long count, int64_t at)
+{
+    // sealed and written in one go
+    for(long i = 0; i < count; i++){
+        Hash_seal(&pages[i]);
+    }
+    if(Stats_write(pwrite(fd, pages, count * DB_PAGE_SIZE, at)) != count * DB_PAGE_SIZE){
+        die("Failed to write hash index", conn);
+    }
+}
+
+int64_t Hash_write(struct Connection *conn, int fd, int64_t at, int keys_fd, long count, int buckets)
+// lay out an index of the count keys Hash_spill put in keys_fd at at:
+// a page per bucket, then the extra pages of buckets that don't fit
+// in one.  HASH_BUILD_PAGES buckets are filled at a time, each from
+// one pass over the keys, and a page that fills up is written out
+// there and then, the bucket carrying on in an extra page, so no more
+// than that many pages are ever held.  Returns where it ends.
+{
+    long held = buckets < HASH_BUILD_PAGES ? buckets : HASH_BUILD_PAGES;
+    struct HashPage *area = Stats_malloc(held * sizeof(struct HashPage));
+    int64_t *where = Stats_malloc(held * sizeof(int64_t));
+    struct Reader reader = {.cap = READER_SIZE};
+    int64_t extra = at + (int64_t)buckets * DB_PAGE_SIZE;
+    long first = 0;
+    long i = 0;
+
+    if(!area || !where){
+        die("Memory error", conn);
+    }
+
+    for(first = 0; first < buckets; first += held){
+        long n = buckets - first < held ? buckets - first : held;
+
+        memset(area, 0, n * sizeof(struct HashPage));
+        for(i = 0; i < n; i++){
+            where[i] = at + (first + i) * DB_PAGE_SIZE;
+        }
+
+        for(long done = 0; done < count; ){
+            long got = 0;
+            struct HashEntry *keys = (struct HashEntry *)Reader_get(keys_fd, &reader,
+                    done * sizeof(struct HashEntry), sizeof(struct HashEntry), &got);
+            if(!keys || got < (long)sizeof(struct HashEntry)){
+                die("Failed to read the hash index's keys", conn);
+            }
+            got /= sizeof(struct HashEntry);
+            got = got < count - done ? got : count - done;
+
+            for(i = 0; i < got; i++){
+                long bucket = keys[i].hash % buckets - first;
+                if(bucket < 0 || bucket >= n){
+                    continue;
+                }
+                struct HashPage *page = &area[bucket];
+                if(page->count == HASH_PAGE_ENTRIES){
+                    page->next = extra;
+                    Hash_put_pages(conn, fd, page, 1, where[bucket]);
+                    memset(page, 0, sizeof(*page));
+                    where[bucket] = extra;
+                    extra += DB_PAGE_SIZE;
+                }
+                page->entries[page->count++] = keys[i];
+            }
+            done += got;
+        }
+
+        // the buckets still in their own pages are one run
+        for(i = 0; i < n; ){
+            long run = 1;
+            while(i + run < n && where[i + run] == where[i] + run * DB_PAGE_SIZE){
+                run++;
+            }
+            Hash_put_pages(conn, fd, &area[i], run, where[i]);
+            i += run;
+        }
+    }
+
+    Reader_close(&reader);
+    free(area);
+    free(where);
+
+    return extra;
+}
+
+void Hash_build(struct Connection *conn, int keys)
+// index keys (DB_HASH_EMAIL, DB_HASH_NAME or both, 0 for no index) of
+// every set row in new bucket pages at the end of the file, half full
+// so the table can double before buckets spill into more pages.  Only
+// the header points at them, so writing it is what switches over, and
+// the old pages become garbage.  Every row has to be clean, as they
+// are right after a checkpoint.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    struct Writer spill;
+    long count = 0;
+    int64_t at = 0;
+    int buckets = 0;
+    int i = 0;
+
+    if(keys){
+        Database_load(conn);
+        int keys_fd = Hash_spill(conn, &spill);
+        for(i = Database_next_set(db, 0); i < db->max_rows; i = Database_next_set(db, i + 1)){
+            struct Address *addr = &((struct Address *)db->rows)[i];
+            struct HashEntry row[2];
+            int k = Hash_row(keys, i, addr->name, strlen(addr->name), addr->email, strlen(addr->email), row);
+            Writer_put(conn, &spill, row, k * sizeof(struct HashEntry));
+            count += k;
+        }
+        Writer_close(conn, &spill);
+
+        buckets = count / HASH_FILL + 1;
+        at = lseek(fd, 0, SEEK_END);
+        Hash_write(conn, fd, at, keys_fd, count, buckets);
+        close(keys_fd);
+        if(Stats_sync(fsync(fd)) == -1){
+            die("Cannot sync database", conn);
+        }
+    }
+
+    // every page of the old index, the ones buckets spilled into too
+    for(i = 0; i < db->hash_buckets; i++){
+        struct HashPage page;
+        int64_t next = db->hash + (int64_t)i * DB_PAGE_SIZE;
+        while(next){
+            const char *error = Hash_read_page(fd, next, &page);
+            if(error){
+                die(error, conn);
+            }
+            db->garbage += DB_PAGE_SIZE;
+            next = page.next;
+        }
+    }
+    db->flags = (db->flags & ~DB_HASH_KEYS) | keys;
+    db->hash = at;
+    db->hash_buckets = buckets;
+    db->generation += 2;
+    Database_write_header(conn);
+    if(Stats_sync(fsync(fd)) == -1){
+        die("Cannot sync database", conn);
+    }
+}
+
+void Hash_patch(struct Connection *conn, int64_t at, struct HashOp *ops, long count, int64_t *end)
+// apply one bucket's ops to its pages, all held at once.  Adding a key
+// that is there already, or taking out one that isn't, does nothing.
+// A bucket with no room gets a new page at *end; one that gets too
+// long has the index rebuilt bigger after the checkpoint.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    struct HashPage *pages = NULL;
+    int64_t *where = NULL;
+    long n = 0;
+    long cap = 0;
+    long i = 0;
+
+    for(;;){
+        if(n == cap){
+            cap = cap ? cap * 2 : 4;
+            pages = Stats_realloc(pages, cap * sizeof(struct HashPage));
+            where = Stats_realloc(where, cap * sizeof(int64_t));
+            if(!pages || !where){
+                die("Memory error", conn);
+            }
+        }
+        if(!at){
+            break;
+        }
+        const char *error = Hash_read_page(fd, at, &pages[n]);
+        if(error){
+            die(error, conn);
+        }
+        where[n++] = at;
+        at = pages[n - 1].next;
+    }
+
+    for(i = 0; i < count; i++){
+        struct HashPage *page = NULL;
+        long slot = -1;
+        long p = 0;
+
+        for(p = 0; p < n && slot == -1; p++){
+            for(long e = 0; e < pages[p].count; e++){
+                if(pages[p].entries[e].hash == ops[i].hash && pages[p].entries[e].id == ops[i].id){
+                    page = &pages[p];
+                    slot = e;
+                    break;
+                }
+            }
+        }
+
+        if(!ops[i].add){
+            if(page){
+                page->entries[slot] = page->entries[--page->count];
+            }
+            continue;
+        }
+        if(page){
+            continue;
+        }
+        for(p = 0; p < n && pages[p].count == HASH_PAGE_ENTRIES; p++){
+        }
+        if(p == n){
+            // the room for it was made by the read loop above
+            memset(&pages[n], 0, sizeof(struct HashPage));
+            pages[n - 1].next = *end;
+            where[n++] = *end;
+            *end += DB_PAGE_SIZE;
+            if(n >= HASH_MAX_CHAIN){
+                db->hash_grow = 1;
+            }
+            if(n == cap){
+                cap *= 2;
+                pages = Stats_realloc(pages, cap * sizeof(struct HashPage));
+                where = Stats_realloc(where, cap * sizeof(int64_t));
+                if(!pages || !where){
+                    die("Memory error", conn);
+                }
+            }
+        }
+        pages[p].entries[pages[p].count].hash = ops[i].hash;
+        pages[p].entries[pages[p].count++].id = ops[i].id;
+    }
+
+    for(i = 0; i < n; i++){
+        Hash_seal(&pages[i]);
+        Database_stage(conn, where[i], &pages[i], sizeof(struct HashPage));
+    }
+    free(pages);
+    free(where);
+}
+
+int HashOp_compare(const void *a, const void *b)
+{
+    const struct HashOp *x = a;
+    const struct HashOp *y = b;
+
+    if(x->bucket != y->bucket){
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+void Hash_update(struct Connection *conn, struct Entry *entries, int count, int64_t *end)
+// take each dirty row's old keys out of the hash index and put its new
+// ones in.  The old keys come from the record the table still points
+// at, so this runs before the table is patched, and a redo after a
+// crash may find the new record there instead, which only leaves a
+// stale key behind; lookups check every row they find anyway.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    int64_t table[DB_TABLE_CHUNK];
+    int chunk = -1;
+    long n = 0;
+    int i = 0;
+
+    if(!db->hash){
+        return;
+    }
+
+    struct HashOp *ops = Stats_malloc((4 * (long)count + 1) * sizeof(struct HashOp));
+    if(!ops){
+        die("Memory error", conn);
+    }
+
+    for(i = 0; i < count; i++){
+        struct Address *addr = &((struct Address *)db->rows)[entries[i].id];
+        struct HashEntry keys[4];
+        int64_t old = 0;
+        int k = 0;
+
+        if(addr->id < db->disk_rows){
+            if(addr->id / DB_TABLE_CHUNK != chunk){
+                long size = 0;
+                chunk = addr->id / DB_TABLE_CHUNK;
+                const char *error = Database_read_chunk(db, fd, chunk, table, &size);
+                if(error){
+                    die(error, conn);
+                }
+            }
+            old = table[addr->id % DB_TABLE_CHUNK];
+        }
+        if(old){
+            char *name = NULL;
+            char *email = NULL;
+            int lens[2] = {0};
+            Database_read_strings(conn, addr->id, old, &name, &email, lens);
+            k = Hash_row(db->flags, addr->id, name, lens[0], email, lens[1], keys);
+        }
+        int removes = k;
+        if(addr->set){
+            k += Hash_row(db->flags, addr->id, addr->name, strlen(addr->name), addr->email,
+                    strlen(addr->email), keys + k);
+        }
+
+        for(int j = 0; j < k; j++){
+            ops[n].hash = keys[j].hash;
+            ops[n].id = keys[j].id;
+            ops[n].bucket = keys[j].hash % db->hash_buckets;
+            ops[n].add = j >= removes;
+            ops[n].order = n;
+            n++;
+        }
+    }
+    qsort(ops, n, sizeof(struct HashOp), HashOp_compare);
+
+    for(long first = 0, last = 0; first < n; first = last){
+        while(last < n && ops[last].bucket == ops[first].bucket){
+            last++;
+        }
+        Hash_patch(conn, db->hash + (int64_t)ops[first].bucket * DB_PAGE_SIZE, ops + first, last - first, end);
+    }
+    free(ops);
+}
+
+void Hash_find(struct Connection *conn, int field, const char *key)
+// the ids the hash index has under key's hash, into db->hits.  Some
+// may not have key at all (a collision, or a row changed since the
+// last checkpoint), so Database_exact checks each one's row.
+{
+    struct Database *db = conn->db;
+    uint32_t hash = Hash_key(field, key, strlen(key));
+    int64_t at = db->hash + (int64_t)(hash % db->hash_buckets) * DB_PAGE_SIZE;
+    struct HashPage page;
+    long cap = 16;
+
+    free(db->hits);
+    db->hit_count = 0;
+    db->hits = Stats_malloc(cap * sizeof(int));
+    if(!db->hits){
+        die("Memory error", conn);
+    }
+
+    while(at){
+        const char *error = Hash_read_page(fileno(conn->file), at, &page);
+        if(error){
+            die(error, conn);
+        }
+        for(int i = 0; i < page.count; i++){
+            if(page.entries[i].hash != hash){
+                continue;
+            }
+            if(db->hit_count == cap){
+                cap *= 2;
+                int *hits = Stats_realloc(db->hits, cap * sizeof(int));
+                if(!hits){
+                    die("Memory error", conn);
+                }
+                db->hits = hits;
+            }
+            db->hits[db->hit_count++] = page.entries[i].id;
+        }
+        at = page.next;
+    }
+}
+
+void Hash_prefetch(struct Connection *conn, int field, const char *key)
+{
+    // what Database_exact will look at, for a snapshot
+    struct Database *db = conn->db;
+
+    if(!(db->flags & field)){
+        Database_load(conn);
+        return;
+    }
+
+    Hash_find(conn, field, key);
+    for(long i = 0; i < db->hit_count; i++){
+        if(db->hits[i] >= 0 && db->hits[i] < db->max_rows){
+            Database_row(conn, db->hits[i]);
+        }
+    }
+}
+
+void Database_rewrite_chunk(struct Connection *conn, int out, long chunk, int64_t *table,
+        int max_rows, int64_t table_at, uint32_t *sums)
+{
+    // one chunk of Database_rewrite's new table, and its crc; the last one may be short
+    long count = max_rows - chunk * DB_TABLE_CHUNK;
+    long size = (count < DB_TABLE_CHUNK ? count : DB_TABLE_CHUNK) * sizeof(int64_t);
+
+    if(Stats_write(pwrite(out, table, size, table_at + chunk * DB_PAGE_SIZE)) != size){
+        die("Failed to write row table", conn);
+    }
+    sums[chunk] = Crc32_compute(table, size);
+}
+
+void Database_rewrite(struct Connection *conn, int max_data, int max_rows, int flags)
+// copy the database row by row into <dbfile>.resize with the given
+// sizes and flags, then rename it over the old file.  Only the set
+// bitmap and one chunk of each table are held, records go straight
+// from a Reader's buffer into a Writer (through a Packer if the
+// new file is compressed), so memory doesn't grow with the data.
+// The hash index's keys go into a file of their own (Hash_spill) on
+// the way, and Hash_write lays the index out from that at the end.
+// Rows changed in RAM are copied from there.  Nothing is ever
+// written into the old file except, at the very end, a header that
+// tells readers still using it that it has been replaced.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    int rows = db->max_rows < max_rows ? db->max_rows : max_rows;
+    int64_t old_table[DB_TABLE_CHUNK];
+    int64_t new_table[DB_TABLE_CHUNK];
+    int old_chunk = -1;
+    int new_chunk = -1;
+    struct Writer records;
+    const char *error = NULL;
+    struct Writer spill;
+    int keys_fd = -1;
+    long key_count = 0;
+    int i = 0;
+
+    // version 1 files have no table to read rows from one at a time
+    if(db->version < 2){
+        Database_load(conn);
+    }
+    Database_load_bits(conn);
+    int was = Stats_phase(STATS_WRITE);
+    // the records are read in id order, which is mostly file order
+    db->reader.cap = READER_SIZE;
+
+    char *path = Stats_malloc(strlen(conn->path) + 8);
+    if(!path){
+        die("Memory error", conn);
+    }
+    sprintf(path, "%s.resize", conn->path);
+
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out == -1){
+        free(path);
+        die("Failed to create the resized database", conn);
+    }
+
+    // both header slots, bitmap pages, table, a crc per page, then the records
+    long bits_space = (Database_bits_size(max_rows) + DB_PAGE_SIZE - 1) / DB_PAGE_SIZE * DB_PAGE_SIZE;
+    long chunks = ((long)max_rows + DB_TABLE_CHUNK - 1) / DB_TABLE_CHUNK;
+    long pages = bits_space / DB_PAGE_SIZE + chunks;
+    int64_t map_at = 2 * DB_HEADER_SLOT;
+    int64_t table_at = map_at + bits_space;
+    int64_t sums_at = table_at + (long)max_rows * sizeof(int64_t);
+    int64_t start = sums_at + pages * sizeof(uint32_t);
+
+    uint64_t *bits = Stats_calloc(1, bits_space);
+    uint32_t *sums = Stats_calloc(pages, sizeof(uint32_t));
+    if(!bits || !sums){
+        free(bits);
+        free(path);
+        close(out);
+        die("Memory error", conn);
+    }
+
+    if(ftruncate(out, start) == -1){
+        die("Cannot size the resized database", conn);
+    }
+    Writer_open(conn, &records, out, start);
+    struct Packer *packer = flags & DB_COMPRESSED ? Packer_open(conn, &records) : NULL;
+    if(flags & DB_HASH_KEYS){
+        keys_fd = Hash_spill(conn, &spill);
+    }
+
+    // chunks with no rows in them are never written, they stay zeroes
+    memset(new_table, 0, sizeof(new_table));
+    for(long chunk = 0; chunk < chunks; chunk++){
+        long count = max_rows - chunk * DB_TABLE_CHUNK;
+        long size = (count < DB_TABLE_CHUNK ? count : DB_TABLE_CHUNK) * sizeof(int64_t);
+        sums[bits_space / DB_PAGE_SIZE + chunk] = Crc32_compute(new_table, size);
+    }
+
+    for(i = Database_next_set(db, 0); i < rows; i = Database_next_set(db, i + 1)){
+        struct Address *addr = &((struct Address *)db->rows)[i];
+        char *name = addr->name;
+        char *email = addr->email;
+        int lens[2] = {0};
+
+        if(!addr->loaded){
+            if(i / DB_TABLE_CHUNK != old_chunk){
+                long size = 0;
+                old_chunk = i / DB_TABLE_CHUNK;
+                error = Database_read_chunk(db, fd, old_chunk, old_table, &size);
+                if(error){
+                    die(error, conn);
+                }
+            }
+            Database_read_strings(conn, i, old_table[i % DB_TABLE_CHUNK], &name, &email, lens);
+        } else {
+            lens[0] = strlen(name);
+            lens[1] = strlen(email);
+        }
+
+        if(i / DB_TABLE_CHUNK != new_chunk){
+            if(new_chunk != -1){
+                // a block never spans two chunks, its entries have to be in this one
+                if(packer){
+                    Packer_flush(conn, packer);
+                }
+                Database_rewrite_chunk(conn, out, new_chunk, new_table, max_rows, table_at, sums + bits_space / DB_PAGE_SIZE);
+            }
+            new_chunk = i / DB_TABLE_CHUNK;
+            memset(new_table, 0, sizeof(new_table));
+        }
+        bits[i / 64] |= (uint64_t)1 << (i % 64);
+
+        // data can be truncated if max_data is set too small
+        if(lens[0] > max_data - 1){
+            lens[0] = max_data - 1;
+        }
+        if(lens[1] > max_data - 1){
+            lens[1] = max_data - 1;
+        }
+        if(packer){
+            Packer_add(conn, packer, &new_table[i % DB_TABLE_CHUNK], i, name, lens[0], email, lens[1]);
+        } else {
+            new_table[i % DB_TABLE_CHUNK] = records.offset + records.len;
+            Database_put_record(conn, &records, i, name, lens[0], email, lens[1]);
+        }
+
+        if(flags & DB_HASH_KEYS){
+            struct HashEntry keys[2];
+            int k = Hash_row(flags, i, name, lens[0], email, lens[1], keys);
+            Writer_put(conn, &spill, keys, k * sizeof(struct HashEntry));
+            key_count += k;
+        }
+    }
+    if(packer){
+        Packer_close(conn, packer);
+    }
+    Writer_close(conn, &records);
+    if(new_chunk != -1){
+        Database_rewrite_chunk(conn, out, new_chunk, new_table, max_rows, table_at, sums + bits_space / DB_PAGE_SIZE);
+    }
+
+    // the hash index goes after the records, built afresh
+    int64_t hash_at = 0;
+    int buckets = 0;
+    if(flags & DB_HASH_KEYS){
+        hash_at = records.offset;
+        buckets = key_count / HASH_FILL + 1;
+        Writer_close(conn, &spill);
+        Hash_write(conn, out, hash_at, keys_fd, key_count, buckets);
+        close(keys_fd);
+    }
+
+    for(long page = 0; page < bits_space / DB_PAGE_SIZE; page++){
+        sums[page] = Crc32_compute((char *)bits + page * DB_PAGE_SIZE, DB_PAGE_SIZE);
+    }
+
+    // odd, so readers keep away until the old log is gone
+    char slot[DB_HEADER_SLOT] = {0};
+    struct Header header = {DB_MAGIC, DB_VERSION, max_data, max_rows, 0, map_at, 1, 0, flags, hash_at, buckets};
+    header.crc = Header_crc(&header);
+    memcpy(slot, &header, sizeof(header));
+    if(Stats_write(pwrite(out, slot, sizeof(slot), 0)) != sizeof(slot)
+            || Stats_write(pwrite(out, bits, bits_space, map_at)) != bits_space
+            || Stats_write(pwrite(out, sums, pages * sizeof(uint32_t), sums_at)) != (long)(pages * sizeof(uint32_t))){
+        die("Failed to write the resized database", conn);
+    }
+    free(bits);
+    free(sums);
+
+    // the new file has to be complete on disk before it replaces the old one
+    if(Stats_sync(fsync(out)) == -1 || close(out) == -1){
+        die("Cannot sync the resized database", conn);
+    }
+    if(rename(path, conn->path) == -1){
+        free(path);
+        die("Failed to replace the database", conn);
+    }
+    free(path);
+
+    // readers that opened the old file see its header change and start
+    // over on the new one; it has to happen before the log is emptied
+    char retired[2 * DB_HEADER_SLOT] = {0};
+    long size = db->version >= 7 ? (long)sizeof(retired) : (long)sizeof(int);
+    if(Stats_write(pwrite(fd, retired, size, 0)) != size){
+        die("Failed to retire the old database", conn);
+    }
+
+    // the log is folded into the new file now
+    conn->wal_len = 0;
+    conn->wal_uncommitted = 0;
+    if(ftruncate(conn->wal, 0) == -1){
+        die("Cannot truncate the write-ahead log", conn);
+    }
+    conn->wal_size = 0;
+
+    fclose(conn->file);
+    conn->file = fopen(conn->path, "r+");
+    if(!conn->file){
+        die("Failed to open the file", conn);
+    }
+    db->version = DB_VERSION;
+    db->max_data = max_data;
+    db->flags = flags;
+    db->hash = hash_at;
+    db->hash_buckets = buckets;
+    db->disk_rows = max_rows;
+    db->table = map_at;
+    db->garbage = 0;
+    db->generation = 2;
+    db->header_slot = 0;
+    Database_write_header(conn);
+
+    // holding pieces of the old file
+    Reader_close(&db->reader);
+    Block_free(&db->block);
+    Stats_phase(was);
+}
+
+void Database_move_table(struct Connection *conn, struct Entry *entries, int count, int64_t end)
+// the table has outgrown its place in the file: write a bitmap and
+// table for max_rows at end, holding the old entries and then the
+// ones this write changed, and the crcs of their pages.  Only the
+// header still points at the old ones, so the caller's
+// Database_write_header is what switches over.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    long bits_size = Database_bits_size(db->max_rows);
+    long bits_space = (bits_size + DB_PAGE_SIZE - 1) / DB_PAGE_SIZE * DB_PAGE_SIZE;
+    long table_size = (long)db->max_rows * sizeof(int64_t);
+    long pages = bits_space / DB_PAGE_SIZE + (db->max_rows + DB_TABLE_CHUNK - 1) / DB_TABLE_CHUNK;
+    long size = bits_space + table_size + pages * sizeof(uint32_t);
+    long old_size = Database_sum_offset(db, Database_bits_space(db, db->disk_rows) / DB_PAGE_SIZE
+            + (db->disk_rows + DB_TABLE_CHUNK - 1) / DB_TABLE_CHUNK) - db->table;
+    struct Writer out;
+    long chunk_size = 0;
+    long page = 0;
+    int i = 0;
+
+    char *area = Stats_calloc(1, size);
+    if(!area){
+        die("Memory error", conn);
+    }
+    memcpy(area, db->set_bits, bits_size);
+
+    int64_t *table = (int64_t *)(area + bits_space);
+    for(i = 0; i < db->disk_rows; i += DB_TABLE_CHUNK){
+        const char *error = Database_read_chunk(db, fd, i / DB_TABLE_CHUNK, table + i, &chunk_size);
+        if(error){
+            free(area);
+            die(error, conn);
+        }
+    }
+    for(i = 0; i < count; i++){
+        table[entries[i].id] = entries[i].offset;
+    }
+
+    uint32_t *sums = (uint32_t *)(area + bits_space + table_size);
+    for(page = 0; page < pages; page++){
+        long left = bits_space + table_size - page * DB_PAGE_SIZE;
+        sums[page] = Crc32_compute(area + page * DB_PAGE_SIZE, left < DB_PAGE_SIZE ? left : DB_PAGE_SIZE);
+    }
+
+    Writer_open(conn, &out, fd, end);
+    Writer_put(conn, &out, area, size);
+    Writer_close(conn, &out);
+    free(area);
+
+    db->garbage += old_size;
+    db->disk_rows = db->max_rows;
+    db->table = end;
+}
+
+int Entry_compare(const void *a, const void *b)
+{
+    return ((const struct Entry *)a)->id - ((const struct Entry *)b)->id;
+}
+
+void Database_write_dirty(struct Connection *conn)
+// set rows get a fresh record appended to the end of the file
+// (packed into blocks if the file is compressed), then each dirty
+// row's table entry is pointed at its record (or at 0 for a deleted
+// row).  Records are never overwritten, the ones nothing points at
+// any more are counted as garbage.  Records are gathered in a Writer
+// in id order and entries are written in runs of neighbouring ids,
+// so a big import is a few big writes.
+{
+    struct Database *db = conn->db;
+    int fd = fileno(conn->file);
+    struct Entry *entries = NULL;
+    struct Writer records;
+    int64_t table[DB_TABLE_CHUNK];
+    int old_chunk = -1;
+    int count = 0;
+    int i = 0;
+
+    Database_load_bits(conn);
+
+    // everything up to Database_put_staged only appends to the file,
+    // so readers go on reading the state before this one until then
+    entries = Stats_malloc((db->loaded_count + 1) * sizeof(struct Entry));
+    if(!entries){
+        die("Memory error", conn);
+    }
+    Writer_open(conn, &records, fd, lseek(fd, 0, SEEK_END));
+    struct Packer *packer = db->flags & DB_COMPRESSED ? Packer_open(conn, &records) : NULL;
+
+    for(i = 0; i < db->loaded_count; i++){
+        struct Address *addr = &((struct Address *)db->rows)[db->loaded_ids[i]];
+        if(addr->dirty){
+            entries[count].id = addr->id;
+            entries[count].offset = 0;
+            count++;
+        }
+    }
+    qsort(entries, count, sizeof(struct Entry), Entry_compare);
+
+    // the old records of rows that were never loaded are read to
+    // count them as garbage: their table entries a chunk at a time, the
+    // records through db->reader, which in id order is mostly file order
+    long was_cap = db->reader.cap;
+    db->reader.cap = READER_SIZE;
+    for(i = 0; i < count; i++){
+        struct Address *addr = &((struct Address *)db->rows)[entries[i].id];
+
+        if(addr->disk_size == -1){
+            char *name = NULL;
+            char *email = NULL;
+            int lens[2] = {0};
+
+            if(addr->id / DB_TABLE_CHUNK != old_chunk){
+                long size = 0;
+                old_chunk = addr->id / DB_TABLE_CHUNK;
+                const char *error = Database_read_chunk(db, fd, old_chunk, table, &size);
+                if(error){
+                    die(error, conn);
+                }
+            }
+            int64_t entry = table[addr->id % DB_TABLE_CHUNK];
+            addr->disk_size = entry ? Database_read_strings(conn, addr->id, entry, &name, &email, lens) : 0;
+        }
+        db->garbage += addr->disk_size;
+
+        if(!addr->set){
+            continue;
+        }
+        if(packer){
+            Packer_add(conn, packer, &entries[i].offset, addr->id, addr->name, strlen(addr->name),
+                    addr->email, strlen(addr->email));
+        } else {
+            entries[i].offset = records.offset + records.len;
+            Database_put_record(conn, &records, addr->id, addr->name, strlen(addr->name),
+                    addr->email, strlen(addr->email));
+        }
+    }
+
+    // records first, so no entry ever points past the end of the file
+    if(packer){
+        Packer_close(conn, packer);
+    }
+    Writer_close(conn, &records);
+    int64_t end = records.offset;
+    // which reads the same old records again, for their keys
+    Hash_update(conn, entries, count, &end);
+    db->reader.cap = was_cap;
+
+    if(db->disk_rows != db->max_rows){
+        Database_move_table(conn, entries, count, end);
+        count = 0;
+    }
+
+    // each table page with a changed entry is read (checking its crc),
+    // patched and written back whole with its new crc, and so is each
+    // bitmap page with a changed flag, straight from set_bits
+    uint64_t bits[DB_PAGE_SIZE / sizeof(uint64_t)];
+    long bits_size = Database_bits_size(db->disk_rows);
+    long bits_pages = Database_bits_space(db, db->disk_rows) / DB_PAGE_SIZE;
+    long bits_page = -1;
+    for(i = 0; i < count; ){
+        int chunk = entries[i].id / DB_TABLE_CHUNK;
+        long size = 0;
+
+        const char *error = Database_read_chunk(db, fd, chunk, table, &size);
+        if(error){
+            die(error, conn);
+        }
+        do {
+            long page = entries[i].id / (DB_PAGE_SIZE * 8);
+            if(page != bits_page){
+                long at = page * DB_PAGE_SIZE;
+                memset(bits, 0, sizeof(bits));
+                memcpy(bits, (char *)db->set_bits + at, bits_size - at < DB_PAGE_SIZE ? bits_size - at : DB_PAGE_SIZE);
+                Database_write_page(conn, page, bits, DB_PAGE_SIZE);
+                bits_page = page;
+            }
+            table[entries[i].id % DB_TABLE_CHUNK] = entries[i].offset;
+            i++;
+        } while(i < count && entries[i].id / DB_TABLE_CHUNK == chunk);
+
+        Database_write_page(conn, bits_pages + chunk, table, size);
+    }
+    free(entries);
+
+    // the header goes last with the pages, so a redo brings it too
+    char slot[DB_HEADER_SLOT];
+    long at = (!db->header_slot) * DB_HEADER_SLOT;
+    db->generation += 2 - db->generation % 2;
+    Database_pack_header(conn, slot);
+    Database_stage(conn, at, slot, DB_HEADER_SLOT);
+    Wal_log_staged(conn);
+
+    // readers that look while the pages change find an odd generation
+    // where the new header is going, and start over.  It isn't in the
+    // log, but the P is, so after a crash Wal_redo writes over it.
+    db->generation--;
+    Database_pack_header(conn, slot);
+    Database_put_page(conn, at, slot, DB_HEADER_SLOT);
+    db->generation++;
+    db->header_slot = !db->header_slot;
+    Database_put_staged(conn);
+}
+
+void Database_write(struct Connection *conn)
+// rows that are not dirty are already correct on disk, so normally
+// only dirty rows are written; create and upgrading an older file
+// rewrite everything
+{
+    struct Database *db = conn->db;
+    int i = 0;
+
+    if(db->rewrite){
+        Database_rewrite(conn, db->max_data, db->max_rows, db->flags);
+    } else {
+        Database_write_dirty(conn);
+    }
+
+    for(i = 0; i < db->loaded_count; i++){
+        struct Address *addr = &((struct Address *)db->rows)[db->loaded_ids[i]];
+        addr->dirty = 0;
+        addr->disk_size = addr->set ? Database_record_size(addr) : 0;
+    }
+    db->rewrite = 0;
+}
+
+void Database_checkpoint(struct Connection *conn)
+// fold everything the log holds into the database file, make
+// sure it is on disk, and only then throw the log away
+{
+    int was = Stats_phase(STATS_WRITE);
+
+    Database_write(conn);
+
+    if(Stats_sync(fsync(fileno(conn->file))) == -1){
+        die("Cannot sync database", conn);
+    }
+
+    conn->wal_len = 0;
+    conn->wal_unsynced = 0;
+    conn->wal_uncommitted = 0;
+    if(ftruncate(conn->wal, 0) == -1){
+        die("Cannot truncate the write-ahead log", conn);
+    }
+    conn->wal_size = 0;
+
+    // a file a writer died checkpointing before there were p records
+    if(conn->db->generation % 2){
+        conn->db->generation++;
+        Database_write_header(conn);
+    }
+    conn->wal_pages = 0;
+
+    if(conn->db->hash_grow){
+        conn->db->hash_grow = 0;
+        Hash_build(conn, conn->db->flags & DB_HASH_KEYS);
+    }
+    Stats_phase(was);
+}
+
+void Database_recover(struct Connection *conn)
+{
+    // the last writer died in the middle of a checkpoint.  Wal_replay
+    // has already finished its page writes if they made it into the
+    // log, and if they didn't it never started them; either way the
+    // log still holds the rows it was writing, so doing it again
+    // brings the file up to date, and one header says so.
+    if(conn->writer && (conn->db->generation % 2 || conn->wal_pages)){
+        Database_checkpoint(conn);
+    }
+}
+
+void Wal_commit(struct Connection *conn)
+// one write and one fsync for every record appended since the
+// last commit, ending in the C record that makes them count, then
+// checkpoint if the log has grown too big
+{
+    int was = Stats_phase(STATS_WRITE);
+
+    if(conn->wal_uncommitted){
+        Wal_put(conn, 'C', 0, "", 0, "", 0);
+        conn->wal_uncommitted = 0;
+    }
+    Wal_flush(conn);
+
+    // nothing was logged, e.g. after a 'g' or 'l'
+    if(conn->wal_unsynced){
+        if(Stats_sync(fsync(conn->wal)) == -1){
+            die("Cannot sync the write-ahead log", conn);
+        }
+        conn->wal_unsynced = 0;
+
+        if(conn->wal_size >= WAL_CHECKPOINT_BYTES){
+            Database_checkpoint(conn);
+        }
+    }
+
+    Stats_phase(was);
+}
+
+void Database_create(struct Connection *conn)
+// we're not saving name/email data for un-set rows, so all
+// this needs to do is set the id=i and set=0 so subsequent
+// file read operations have the information they need
+{
+    int i = 0;
+
+    conn->db->set_bits = Stats_calloc(1, Database_bits_size(conn->db->max_rows));
+    if(!conn->db->set_bits){
+        die("Memory error", conn);
+    }
+
+    for(i = 0; i < conn->db->max_rows; i++) {
+        struct Address *addr = &((struct Address *)conn->db->rows)[i];
+        addr->id = i;
+        Database_flag(conn->db, addr, 0);
+        addr->name = NULL;
+        addr->email = NULL;
+        addr->dirty = 1;
+        addr->disk_size = 0;
+        Database_track(conn, addr);
+    }
+    conn->db->all_loaded = 1;
+
+    Database_full_init(conn);
+}
+
+void Database_set(struct Connection *conn, int id, const char *name, const char *email)
+{
+    if(id >= conn->db->max_rows){
+        Database_grow(conn, id);
+    }
+
+    struct Address *addr = Database_row(conn, id);
+    if(addr->set){
+        die("Already set, delete it first", conn);
+    }
+
+    Database_flag(conn->db, addr, 1);
+    addr->dirty = 1;
+    addr->name = Database_copy_string(conn, name, strlen(name));
+    addr->email = Database_copy_string(conn, email, strlen(email));
+    Index_add(conn, addr);
+}
+
+int Database_insert(struct Connection *conn, const char *name, const char *email)
+{
+    // put the row in the lowest free slot and hand back its id,
+    // which is a new row past the end if none is free
+    Database_load_bits(conn);
+
+    int id = Database_free_id(conn->db);
+
+    Database_apply(conn, 's', id, name, strlen(name), email, strlen(email));
+    fprintf(conn->out, "%d\n", id);
+
+    return id;
+}
+
+void Database_get(struct Connection *conn, int id)
+{
+    struct Address *addr = Database_row(conn, id);
+
+    if(addr->set){
+        Address_write(conn, Database_printer(conn), addr, conn->format);
+        Writer_flush(conn, &conn->print);
+    } else {
+        die("ID is not set", conn);
+    }
+}
+
+void Index_build(struct Connection *conn)
+{
+    struct Database *db = conn->db;
+    int i = 0;
+
+    Database_load(conn);
+
+    // a name and an email for each set row, Index_add grows it from there
+    db->index_cap = 2 * Database_set_count(db) + 2;
+    db->index = Stats_malloc(db->index_cap * sizeof(struct IndexEntry));
+    if(!db->index){
+        die("Memory error", conn);
+    }
+
+    for(i = Database_next_set(db, 0); i < db->max_rows; i = Database_next_set(db, i + 1)){
+        struct Address *addr = &((struct Address *)db->rows)[i];
+        db->index[db->index_count].key = addr->name;
+        db->index[db->index_count].id = i;
+        db->index[db->index_count++].removed = 0;
+        db->index[db->index_count].key = addr->email;
+        db->index[db->index_count].id = i;
+        db->index[db->index_count++].removed = 0;
+    }
+
+    qsort(db->index, db->index_count, sizeof(struct IndexEntry), Index_compare);
+    db->index_sorted = db->index_count;
+    db->index_removed = 0;
+}
+
+int Id_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+struct ScanTile {
+    // the first SCAN_WIDTH bytes of each key, as they sit in memory, so
+    // a short one runs on past its '\0'; keys 2i and 2i + 1 are the
+    // name and email of row ids[i]
+    char keys[SCAN_TILE][SCAN_WIDTH];
+    const char *strings[SCAN_TILE];
+    int ids[SCAN_TILE / 2];
+    int count;
+};
+
+void Scan_pack(struct ScanTile *tile, const char *s)
+{
+    // s comes out of an arena, whose blocks have SCAN_WIDTH bytes to
+    // spare, so this never reads past what was allocated
+    memcpy(tile->keys[tile->count], s, SCAN_WIDTH);
+    tile->strings[tile->count++] = s;
+}
+
+// Each of these gives a bit for every key in the tile whose first
+// width bytes are head's.  Bytes of a key past its '\0' don't matter:
+// head has no '\0' before width, so the '\0' itself already differs.
+
+uint32_t Scan_tile_scalar(char (*keys)[SCAN_WIDTH], const char *head, int width)
+{
+    uint32_t match = 0;
+    int j = 0;
+
+    for(j = 0; j < SCAN_TILE; j++){
+        if(memcmp(keys[j], head, width) == 0){
+            match |= 1u << j;
+        }
+    }
+
+    return match;
+}
+
+#ifdef SCAN_SIMD
+__attribute__((target("avx2")))
+uint32_t Scan_tile_avx2(char (*keys)[SCAN_WIDTH], const char *head, int width)
+{
+    // two keys per compare
+    __m256i term = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)head));
+    uint32_t want = (1u << width) - 1;
+    uint32_t match = 0;
+    int j = 0;
+
+    for(j = 0; j < SCAN_TILE; j += 2){
+        __m256i pair = _mm256_loadu_si256((const __m256i *)keys[j]);
+        uint32_t same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(pair, term));
+        match |= (uint32_t)((same & want) == want) << j;
+        match |= (uint32_t)((same >> 16 & want) == want) << (j + 1);
+    }
+
+    return match;
+}
+
+uint32_t Scan_tile_sse2(char (*keys)[SCAN_WIDTH], const char *head, int width)
+{
+    __m128i term = _mm_loadu_si128((const __m128i *)head);
+    uint32_t want = (1u << width) - 1;
+    uint32_t match = 0;
+    int j = 0;
+
+    for(j = 0; j < SCAN_TILE; j++){
+        __m128i key = _mm_loadu_si128((const __m128i *)keys[j]);
+        uint32_t same = _mm_movemask_epi8(_mm_cmpeq_epi8(key, term));
+        match |= (uint32_t)((same & want) == want) << j;
+    }
+
+    return match;
+}
+#endif
+
+uint32_t (*Scan_tile)(char (*keys)[SCAN_WIDTH], const char *head, int width) = NULL;
+
+void Scan_init()
+{
+    Scan_tile = Scan_tile_scalar;
+#ifdef SCAN_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        Scan_tile = Scan_tile_avx2;
+    } else if(__builtin_cpu_supports("sse2")){
+        Scan_tile = Scan_tile_sse2;
+    }
+#endif
+}
+
+int Database_scan_tile(struct ScanPart *part, struct ScanTile *tile, const char *head)
+// add the tile's rows whose name or email starts with the term, in id
+// order; past SCAN_WIDTH bytes the rest of the term is a strncmp
+{
+    int width = part->len < SCAN_WIDTH ? part->len : SCAN_WIDTH;
+    uint32_t match = Scan_tile(tile->keys, head, width);
+    int j = 0;
+
+    for(j = 0; j < tile->count; j++){
+        if(!(match >> j & 1)){
+            continue;
+        }
+        if(part->len > SCAN_WIDTH && strncmp(tile->strings[j] + SCAN_WIDTH, part->term + SCAN_WIDTH,
+                    part->len - SCAN_WIDTH) != 0){
+            continue;
+        }
+
+        if(part->count == part->cap){
+            long cap = part->cap ? part->cap * 2 : 64;
+            int *ids = Stats_realloc(part->ids, cap * sizeof(int));
+            if(!ids){
+                part->error = "Memory error";
+                return -1;
+            }
+            part->ids = ids;
+            part->cap = cap;
+        }
+        part->ids[part->count++] = tile->ids[j / 2];
+        // so a matching email can't add the row again
+        j |= 1;
+    }
+    tile->count = 0;
+
+    return 0;
+}
+
+void *Database_scan_part(void *arg)
+{
+    // the rows in this part whose name or email starts with the term,
+    // packed SCAN_TILE names and emails at a time for Scan_tile
+    struct ScanPart *part = arg;
+    struct Database *db = part->conn->db;
+    char head[SCAN_WIDTH] = {0};
+    struct ScanTile tile;
+    int i = 0;
+
+    memcpy(head, part->term, part->len < SCAN_WIDTH ? part->len : SCAN_WIDTH);
+    memset(&tile, 0, sizeof(tile));
+    for(i = Database_next_set(db, part->start); i < part->end; i = Database_next_set(db, i + 1)){
+        struct Address *addr = &((struct Address *)db->rows)[i];
+
+        tile.ids[tile.count / 2] = i;
+        Scan_pack(&tile, addr->name);
+        Scan_pack(&tile, addr->email);
+        if(tile.count == SCAN_TILE && Database_scan_tile(part, &tile, head) == -1){
+            return NULL;
+        }
+    }
+    if(tile.count){
+        Database_scan_tile(part, &tile, head);
+    }
+
+    return NULL;
+}
+
+int Database_scan(struct Connection *conn, char *term)
+// print every set row whose name or email starts with term, in id
+// order.  Each part of the table is matched on its own thread, and
+// printing them one after the other keeps the order.
+{
+    struct Database *db = conn->db;
+    struct ScanPart parts[SCAN_MAX_THREADS];
+    long len = strlen(term);
+    int found = 0;
+    int count = 0;
+    int i = 0;
+
+    if(!Scan_tile){
+        Scan_init();
+    }
+    Database_load(conn);
+
+    count = Scan_threads(db);
+    memset(parts, 0, count * sizeof(struct ScanPart));
+    for(i = 0; i < count; i++){
+        parts[i].term = term;
+        parts[i].len = len;
+    }
+    const char *error = Scan_parallel(conn, parts, count, Database_scan_part);
+
+    for(i = 0; i < count && !error; i++){
+        for(long j = 0; j < parts[i].count; j++){
+            Address_write(conn, Database_printer(conn), &((struct Address *)db->rows)[parts[i].ids[j]], conn->format);
+            found = 1;
+        }
+    }
+    if(found){
+        Writer_flush(conn, &conn->print);
+    }
+    for(i = 0; i < count; i++){
+        free(parts[i].ids);
+    }
+
+    if(error){
+        die(error, conn);
+    }
+
+    return found;
+}
+
+void Database_find(struct Connection *conn, char *term)
+{
+    struct Database *db = conn->db;
+    long len = strlen(term);
+    long count = 0;
+    long i = 0;
+
+    // one find is cheaper as a scan than as a sort, so wait for a second
+    if(!db->index && db->finds++ == 0){
+        if(!Database_scan(conn, term) && conn->format == 't'){
+            fprintf(conn->out, "Search term '%s' was not found\n", term);
+        }
+        return;
+    }
+    if(!db->index){
+        Index_build(conn);
+    }
+    Index_merge(conn);
+
+    // every entry starting with term sits in one run from here
+    long first = Index_search(db, term, -1);
+    long last = first;
+    while(last < db->index_count && strncmp(db->index[last].key, term, len) == 0){
+        last++;
+    }
+
+    int *ids = Stats_malloc((last - first + 1) * sizeof(int));
+    if(!ids){
+        die("Memory error", conn);
+    }
+    for(i = first; i < last; i++){
+        ids[count++] = db->index[i].id;
+    }
+    qsort(ids, count, sizeof(int), Id_compare);
+
+    for(i = 0; i < count; i++){
+        if(i == 0 || ids[i] != ids[i - 1]){
+            Address_write(conn, Database_printer(conn), Database_row(conn, ids[i]), conn->format);
+        }
+    }
+    free(ids);
+    Writer_flush(conn, Database_printer(conn));
+
+    if(!count && conn->format == 't'){
+        fprintf(conn->out, "Search term '%s' was not found\n", term);
+    }
+}
+
+void Database_exact(struct Connection *conn, const char *key, int field)
+// print the rows whose email (or name) is exactly key.  The hash
+// index only knows the file as of the last checkpoint, so the rows
+// changed since then are candidates too, and every candidate is
+// checked against the row.  Without an index for field, it scans.
+{
+    struct Database *db = conn->db;
+    long count = 0;
+    long found = 0;
+    long i = 0;
+
+    if(!(db->flags & field)){
+        Database_load(conn);
+        for(i = Database_next_set(db, 0); i < db->max_rows; i = Database_next_set(db, i + 1)){
+            struct Address *addr = &((struct Address *)db->rows)[i];
+            if(strcmp(field == DB_HASH_EMAIL ? addr->email : addr->name, key) == 0){
+                Address_write(conn, Database_printer(conn), addr, conn->format);
+                found++;
+            }
+        }
+    } else {
+        // a snapshot's prefetch has found them already
+        if(!db->hits){
+            Hash_find(conn, field, key);
+        }
+
+        int *ids = Stats_malloc((db->hit_count + db->loaded_count + 1) * sizeof(int));
+        if(!ids){
+            die("Memory error", conn);
+        }
+        for(i = 0; i < db->hit_count; i++){
+            ids[count++] = db->hits[i];
+        }
+        for(i = 0; i < db->loaded_count; i++){
+            if(((struct Address *)db->rows)[db->loaded_ids[i]].dirty){
+                ids[count++] = db->loaded_ids[i];
+            }
+        }
+        free(db->hits);
+        db->hits = NULL;
+        qsort(ids, count, sizeof(int), Id_compare);
+
+        for(i = 0; i < count; i++){
+            if((i > 0 && ids[i] == ids[i - 1]) || ids[i] < 0 || ids[i] >= db->max_rows){
+                continue;
+            }
+            struct Address *addr = Database_row(conn, ids[i]);
+            if(addr->set && strcmp(field == DB_HASH_EMAIL ? addr->email : addr->name, key) == 0){
+                Address_write(conn, Database_printer(conn), addr, conn->format);
+                found++;
+            }
+        }
+        free(ids);
+    }
+    Writer_flush(conn, Database_printer(conn));
+
+    if(!found && conn->format == 't'){
+        fprintf(conn->out, "No row has %s '%s'\n", field == DB_HASH_EMAIL ? "email" : "name", key);
+    }
+}
+
+void Database_delete(struct Connection *conn, int id)
+{
+    // keep disk_size so Database_write knows what the file still holds,
+    // the old strings stay in the arena until Database_close
+    struct Address *addr = Database_row_unread(conn, id);
+
+    Index_remove(conn, addr);
+    Database_flag(conn->db, addr, 0);
+    addr->name = NULL;
+    addr->email = NULL;
+    addr->dirty = 1;
+}
+
+void Database_list(struct Connection *conn)
+{
+    int i = 0;
+    struct Database *db = conn->db;
+
+    Database_load(conn);
+
+    for(i = Database_next_set(db, 0); i < db->max_rows; i = Database_next_set(db, i + 1)){
+        Address_write(conn, Database_printer(conn), &((struct Address *)db->rows)[i], conn->format);
+    }
+    Writer_flush(conn, Database_printer(conn));
+}
+
+void Database_count(struct Connection *conn)
+{
+    // the bitmap alone, no row is read
+    Database_load_bits(conn);
+
+    fprintf(conn->out, "%ld\n", Database_set_count(conn->db));
+}
+
+void Database_stats(struct Connection *conn)
+// how big the database is and what this process has done so far,
+// loading every row first so the record bytes can be added up
+{
+    struct Database *db = conn->db;
+    long count = 0;
+    long records = 0;
+    long i = 0;
+    struct stat st;
+
+    Database_load(conn);
+
+    for(i = 0; i < db->loaded_count; i++){
+        struct Address *addr = &((struct Address *)db->rows)[db->loaded_ids[i]];
+        if(addr->set){
+            count++;
+            records += Database_record_size(addr);
+        }
+    }
+    if(fstat(fileno(conn->file), &st) == -1){
+        die("Cannot stat the database", conn);
     }
-}
 
-void die(const char *message, struct Connection *conn)
-{
-    if(errno){
-        perror(message);
+    fprintf(conn->out, "version: %d\n", db->version);
+    fprintf(conn->out, "max_data: %d\n", db->max_data);
+    fprintf(conn->out, "max_rows: %d (%d in the file)\n", db->max_rows, db->disk_rows);
+    fprintf(conn->out, "rows set: %ld (%ld bytes of records)\n", count, records);
+    fprintf(conn->out, "file: %ld bytes (%ld garbage)\n", (long)st.st_size, (long)db->garbage);
+    fprintf(conn->out, "log: %ld bytes\n", conn->wal_size + conn->wal_len);
+    fprintf(conn->out, "generation: %ld\n", (long)db->generation);
+    fprintf(conn->out, "storage: %s\n", db->flags & DB_COMPRESSED ? "compressed" : "raw");
+    if(db->hash){
+        const char *keys[] = {"", "email", "name", "email and name"};
+        fprintf(conn->out, "hash index: %s (%d buckets)\n", keys[(db->flags & DB_HASH_KEYS) / DB_HASH_EMAIL],
+                db->hash_buckets);
     } else {
-        printf("ERROR: %s\n", message);
+        fprintf(conn->out, "hash index: none\n");
     }
-
-    Database_close(conn);
-
-    exit(1);
+    Stats_print(conn->out);
 }
 
-void Address_print(struct Address *addr)
+char Database_delimiter(const char *filename)
 {
-    printf("%d %s %s\n", addr->id, addr->name, addr->email);
+    const char *dot = filename ? strrchr(filename, '.') : NULL;
+
+    return dot && strcmp(dot, ".tsv") == 0 ? '\t' : ',';
 }
 
-void Database_read_int(struct Connection *conn, void *dest)
+void Database_import_line(struct Connection *conn, char *line, int *starts, long lineno)
+// line holds the three NUL terminated fields at starts[0..2]
 {
-    // read 1 int object from conn->file into dest
-    // dest is typically defined with conn-> notation
-    // e.g. conn->db->max_data or conn->db->rows[i]->id
-    int rc = fread(dest, sizeof(int), 1, conn->file);
-    if(rc == 0){
-        die("No ints read from file", conn);
-    } else if(rc > 1) {
-        die("Too many ints read from file", conn);
+    char *end = NULL;
+    char msg[64];
+    long id = strtol(line, &end, 10);
+
+    if(end == line || *end != '\0'){
+        // a first line that doesn't start with an id is a header
+        if(lineno == 1){
+            return;
+        }
+        snprintf(msg, sizeof(msg), "Bad id on import line %ld", lineno);
+        die(msg, conn);
+    }
+    if(id < 0 || id > INT_MAX){
+        snprintf(msg, sizeof(msg), "Id out of range on import line %ld", lineno);
+        die(msg, conn);
     }
+
+    Database_apply(conn, 's', id, line + starts[1], strlen(line + starts[1]),
+            line + starts[2], strlen(line + starts[2]));
+    Wal_append(conn, 's', id);
 }
 
-void Database_read_char(struct Connection *conn, void *dest)
+void Database_import(struct Connection *conn, const char *filename)
+// one pass over the file in WRITER_SIZE reads, fields are unquoted
+// into line as they are scanned so a quoted field may hold the
+// delimiter, "" for a quote, or a newline.  Every row is logged, and
+// like a batch nothing reaches the log unless the whole file does.
 {
-    char fields[conn->db->max_data];
-    int rc = fread(dest, sizeof(fields), 1, conn->file);
-    if(rc == 0){
-        die("No fields read from file", conn);
-    } else if(rc > 1) {
-        die("Too many fields read from file", conn);
+    char delim = Database_delimiter(filename);
+    int fd = open(filename, O_RDONLY);
+    char *chunk = Stats_malloc(WRITER_SIZE);
+    long line_cap = 256;
+    char *line = Stats_malloc(line_cap);
+    long line_len = 0;
+    int starts[3] = {0};
+    int fields = 0;
+    int quoted = 0;
+    int quote_end = 0;      // just closed a quote, another " is a literal one
+    long lineno = 1;
+    long rc = 1;
+    char msg[64] = "";
+
+    if(fd == -1 || !chunk || !line){
+        if(fd != -1){
+            close(fd);
+        }
+        free(chunk);
+        free(line);
+        die(fd == -1 ? "Failed to open the import file" : "Memory error", conn);
     }
-}
+    conn->wal_hold = 1;
 
-void Database_load(struct Connection *conn)
-{
-    int i = 0;
+    while(rc > 0 && !msg[0]){
+        rc = Stats_read(read(fd, chunk, WRITER_SIZE));
+        if(rc < 0){
+            snprintf(msg, sizeof(msg), "Failed to read the import file");
+            break;
+        }
+        // at the end of the file finish a last line that has no newline
+        if(rc == 0){
+            if(line_len == 0 && fields == 0){
+                break;
+            }
+            chunk[0] = '\n';
+            quoted = 0;
+        }
 
-    for(i = 0; i < conn->db->max_rows; i++){
-        struct Address *addr = &((struct Address *)conn->db->rows)[i];
-        Database_read_int(conn, &addr->id);
-        Database_read_int(conn, &addr->set);
-        if(addr->set){
-            addr->name = malloc(conn->db->max_data);
-            addr->email = malloc(conn->db->max_data);
-            Database_read_char(conn, addr->name);
-            Database_read_char(conn, addr->email);
-        } else {
-            addr->name = NULL;
-            addr->email = NULL;
+        for(long i = 0; i < (rc ? rc : 1); i++){
+            char c = chunk[i];
+            int end_field = 0;
+
+            if(quoted){
+                if(c == '"'){
+                    quoted = 0;
+                    quote_end = 1;
+                    continue;
+                }
+            } else if(c == '"' && (quote_end || line_len == starts[fields])){
+                quoted = 1;
+                if(!quote_end){
+                    continue;
+                }
+            } else if(c == delim || c == '\n'){
+                end_field = 1;
+            } else if(c == '\r'){
+                continue;
+            }
+            quote_end = 0;
+
+            if(line_len + 1 >= line_cap){
+                char *bigger = Stats_realloc(line, line_cap * 2);
+                if(!bigger){
+                    snprintf(msg, sizeof(msg), "Memory error");
+                    break;
+                }
+                line = bigger;
+                line_cap *= 2;
+            }
+            line[line_len++] = end_field ? '\0' : c;
+
+            if(!end_field){
+                continue;
+            }
+            if(c == delim){
+                if(fields == 2){
+                    snprintf(msg, sizeof(msg), "Too many fields on import line %ld", lineno);
+                    break;
+                }
+                starts[++fields] = line_len;
+                continue;
+            }
+
+            // a whole line, blank ones are skipped
+            if(fields == 2){
+                Database_import_line(conn, line, starts, lineno);
+            } else if(fields > 0 || line_len > 1){
+                snprintf(msg, sizeof(msg), "Too few fields on import line %ld", lineno);
+                break;
+            }
+            lineno++;
+            line_len = 0;
+            fields = 0;
         }
     }
 
+    close(fd);
+    free(chunk);
+    free(line);
+
+    if(msg[0]){
+        die(msg, conn);
+    }
+    conn->wal_hold = 0;
 }
 
-struct Connection *Database_open(const char *filename, char mode, int max_data, int max_rows)
+void Database_export(struct Connection *conn, const char *filename)
 {
-    struct Connection *conn = malloc(sizeof(struct Connection));
-    if(!conn){
-        die("Memory error", conn);
+    struct Database *db = conn->db;
+    const char *dot = filename ? strrchr(filename, '.') : NULL;
+    char format = 'c';
+    struct Writer out;
+    int fd = STDOUT_FILENO;
+    int i = 0;
+
+    // the file name picks the format, CSV unless it says otherwise
+    if(dot && strcmp(dot, ".tsv") == 0){
+        format = 'v';
+    } else if(dot && (strcmp(dot, ".json") == 0 || strcmp(dot, ".jsonl") == 0)){
+        format = 'j';
+    } else if(dot && strcmp(dot, ".bin") == 0){
+        format = 'b';
     }
 
-    // set the conn->file pointer
-    // set the conn->db pointer
-    // set the conn->db->max_data and conn->db->max_rows values
-    // conn->db->rows is a void pointer to a block of memory that will hold max_rows Addresses
-    if(mode == 'c'){
-        conn->file = fopen(filename, "w");
-        conn->db = malloc(sizeof(struct Database));
-        conn->db->max_data = max_data;
-        conn->db->max_rows = max_rows;
-        conn->db->rows = malloc(conn->db->max_rows * sizeof(struct Address));
-    } else {
-        conn->file = fopen(filename, "r+");
-        conn->db = malloc(sizeof(struct Database));
-        if(conn->file){
-            Database_read_int(conn, &conn->db->max_data);
-            Database_read_int(conn, &conn->db->max_rows);
-            conn->db->rows = malloc(conn->db->max_rows * sizeof(struct Address));
+    Database_load(conn);
+
+    if(filename){
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1){
+            die("Failed to open the export file", conn);
         }
     }
+    Writer_open(conn, &out, fd, -1);
 
-    if(!conn->file){
-        die("Failed to open the file", conn);
-    }
-    if(!conn->db){
-        die("Failed to allocate database memory", conn);
+    for(i = Database_next_set(db, 0); i < db->max_rows; i = Database_next_set(db, i + 1)){
+        Address_write(conn, &out, &((struct Address *)db->rows)[i], format);
     }
 
-    return conn;
+    Writer_close(conn, &out);
+    if(filename && close(fd) == -1){
+        die("Failed to write the export file", conn);
+    }
 }
 
-void Database_write_int(struct Connection *conn, void *src)
+void Database_execute(struct Connection *conn, int argc, char *argv[])
+// run one g/s/a/d/l/f/n/t/e action against an open connection.  argv is
+// laid out like the command line (argv[2] is the action), so batch
+// lines go through the same argument checks.  s, a and d are only
+// logged here, the caller decides when to Wal_commit them.
 {
-    // read 1 int object into conn->file from src
-    // src is typically defined with conn-> notation
-    // e.g. conn->db->max_data or conn->db->rows[i]->id
-    int rc = fwrite(src, sizeof(int), 1, conn->file);
-    if(rc == 0){
-        die("No ints written to file", conn);
-    } else if(rc > 1) {
-        die("Too many ints written to file", conn);
+    char action = argv[2][0];
+    int id = 0;
+
+    // g, l and f take the output format as an extra last argument
+    conn->format = 't';
+    if(strchr("glf", action) && argc == (action == 'l' ? 4 : 5)){
+        conn->format = Database_format(conn, argv[--argc]);
+    }
+
+    if(argc > 3 && !strchr("fae", action)){
+        id = atoi(argv[3]);
+    }
+    // only a set may go past the end, the database grows for it
+    if(id < 0 || (id >= conn->db->max_rows && action != 's')){
+        die("There aren't that many records", conn);
+    }
+
+    switch(action) {
+        case 'g':
+            if(argc != 4){
+                die("Need an id to get", conn);
+            }
+
+            Database_get(conn, id);
+            break;
+        case 's':
+            if(argc != 6){
+                die("Need id, name and email to set", conn);
+            }
+
+            Database_set(conn, id, argv[4], argv[5]);
+            Wal_append(conn, 's', id);
+            break;
+        case 'a':
+            if(argc != 5){
+                die("Need name and email to add", conn);
+            }
+
+            id = Database_insert(conn, argv[3], argv[4]);
+            Wal_append(conn, 's', id);
+            break;
+        case 'd':
+            if(argc != 4){
+                die("Need id to delete", conn);
+            }
+
+            Database_delete(conn, id);
+            Wal_append(conn, 'd', id);
+            break;
+        case 'l':
+            Database_list(conn);
+            break;
+        case 'f':
+            if(argc != 4){
+                die("Need a search term to look up", conn);
+            }
+            Database_find(conn, argv[3]);
+            break;
+        case 'n':
+            Database_count(conn);
+            break;
+        case 't':
+            Database_stats(conn);
+            break;
+        case 'e': {
+            if(argc != 4 && argc != 5){
+                die("Need an email (or a name, then: name) to look up", conn);
+            }
+            int field = argc == 5 ? Hash_field(conn, argv[4]) : DB_HASH_EMAIL;
+            if(field != DB_HASH_EMAIL && field != DB_HASH_NAME){
+                die("Can only look up an email or a name", conn);
+            }
+            Database_exact(conn, argv[3], field);
+            break;
+        }
+        default:
+            die("Invalid action, only: c=create, g=get, s=set, d=del, l=list, r=resize, f=find, e=exact, n=count, t=stats, a=add, b=batch, u=serve, i=import, x=export, h=hash", conn);
     }
 }
 
-void Database_write_char(struct Connection *conn, void *src)
+int Database_split_line(char *line, char *args[BATCH_MAX_ARGS])
 {
-    char fields[conn->db->max_data];
-    int rc = fwrite(src, sizeof(fields), 1, conn->file);
-    if(rc == 0){
-        die("No fields written to file", conn);
-    } else if(rc > 1) {
-        die("Too many fields written to file", conn);
+    // split a batch/server line into args[2..], keeping args[0..1]
+    int argc = 2;
+    char *arg = strtok(line, " \t\r\n");
+
+    while(arg && argc < BATCH_MAX_ARGS){
+        args[argc++] = arg;
+        arg = strtok(NULL, " \t\r\n");
     }
+
+    return argc;
 }
 
-void Database_write(struct Connection *conn)
-// first write the max_data and max_rows parameters
-// then for every row, write the id and set variables
-// if the row is set, then write two char[max_data]
-// variables for name and email
-// if the row is not set, then move on to the next row
+void Database_batch(struct Connection *conn, FILE *script)
+// one action per line, all against this connection, then a single
+// commit.  A line that fails dies before the commit, so a batch
+// either happens completely or not at all.
 {
-    rewind(conn->file);
+    char *line = NULL;
+    size_t cap = 0;
+    char *args[BATCH_MAX_ARGS] = {"ex17", "batch"};
 
-    Database_write_int(conn, &conn->db->max_data);
-    Database_write_int(conn, &conn->db->max_rows);
+    conn->wal_hold = 1;
 
-    int i = 0;
+    while(getline(&line, &cap, script) != -1){
+        int argc = Database_split_line(line, args);
 
-    for(i = 0; i < conn->db->max_rows; i++){
-        struct Address *addr = &((struct Address *)conn->db->rows)[i];
-        Database_write_int(conn, &addr->id);
-        Database_write_int(conn, &addr->set);
-        if(addr->set){
-            Database_write_char(conn, addr->name);
-            Database_write_char(conn, addr->email);
+        // blank lines and comments
+        if(argc == 2 || args[2][0] == '#'){
+            continue;
+        }
+        if(!strchr("gsadlfnte", args[2][0])){
+            die("Only g, s, a, d, l, f, n, t and e can be batched", conn);
         }
-    }
 
-    int rc = fflush(conn->file);
-    if(rc == -1){
-        die("Cannot flush database", conn);
+        Database_execute(conn, argc, args);
     }
+
+    free(line);
+
+    conn->wal_hold = 0;
+    Wal_commit(conn);
 }
 
-void Database_create(struct Connection *conn)
-// we're not saving name/email data for un-set rows, so all
-// this needs to do is set the id=i and set=0 so subsequent
-// file read operations have the information they need
+struct Client {
+    int fd;
+    char *in;           // bytes received that don't make a full line yet
+    long in_len;
+    char *out;          // replies waiting to be sent
+    long out_len;
+    long out_sent;
+};
+
+volatile sig_atomic_t Server_stop = 0;
+
+void Server_signal(int sig)
 {
-    int i = 0;
+    // which signal stopped the server, 0 while it runs
+    Server_stop = sig;
+}
 
-    for(i = 0; i < conn->db->max_rows; i++) {
-        struct Address *addr = &((struct Address *)conn->db->rows)[i];
-        addr->id = i;
-        addr->set = 0;
-        addr->name = NULL;
-        addr->email = NULL;
+void Server_request(struct Connection *conn, char *line, FILE *out)
+// runs one request line, capturing its output in out and ending the
+// reply with OK or the error die() was called with.  Whatever the
+// request logged before failing is dropped from the log buffer.
+{
+    jmp_buf recover;
+    char *args[BATCH_MAX_ARGS] = {"ex17", "server"};
+    long wal_mark = conn->wal_len;
+    int uncommitted = conn->wal_uncommitted;
+
+    conn->out = out;
+    conn->recover = &recover;
+    errno = 0;
+
+    if(setjmp(recover) == 0){
+        int argc = Database_split_line(line, args);
+        if(argc == 2){
+            die("Empty request", conn);
+        }
+        if(!strchr("gsadlfnte", args[2][0])){
+            die("Only g, s, a, d, l, f, n, t and e can be served", conn);
+        }
+        Database_execute(conn, argc, args);
+        fprintf(out, "OK\n");
+    } else {
+        conn->wal_len = wal_mark;
+        conn->wal_uncommitted = uncommitted;
+        conn->staged_len = 0;
+        conn->print.len = 0;
+        // die() may have jumped out of the middle of a load or write
+        Stats_phase(STATS_OP);
+        fprintf(out, "ERROR: %s\n", conn->error);
     }
+
+    conn->recover = NULL;
+    conn->out = stdout;
 }
 
-void Database_set(struct Connection *conn, int id, const char *name, const char *email)
+void Server_read(struct Connection *conn, struct Client *client)
+// runs every complete line the client has sent so far; leaves
+// client->fd at -1 if the client went away
 {
-    struct Address *addr = &((struct Address *)conn->db->rows)[id];
-    if(addr->set){
-        die("Already set, delete it first", conn);
+    char buf[4096];
+    long rc = read(client->fd, buf, sizeof(buf));
+
+    if(rc <= 0 || client->in_len + rc > SERVER_LINE_MAX){
+        close(client->fd);
+        client->fd = -1;
+        client->in_len = 0;
+        return;
+    }
+
+    char *in = Stats_realloc(client->in, client->in_len + rc);
+    if(!in){
+        die("Memory error", conn);
     }
+    client->in = in;
+    memcpy(client->in + client->in_len, buf, rc);
+    client->in_len += rc;
 
-    addr->set = 1;
-    addr->name = malloc(conn->db->max_data);
-    addr->email = malloc(conn->db->max_data);
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *out = open_memstream(&reply, &reply_len);
+    if(!out){
+        die("Memory error", conn);
+    }
 
-    char *res = strncpy(addr->name, name, conn->db->max_data - 1);
-    addr->name[conn->db->max_data - 1] = '\0';
-    if(!res){
-        die("Name copy failed", conn);
+    char *start = client->in;
+    char *end = NULL;
+    while((end = memchr(start, '\n', client->in + client->in_len - start))){
+        *end = '\0';
+        Server_request(conn, start, out);
+        start = end + 1;
     }
 
-    res = strncpy(addr->email, email, conn->db->max_data - 1);
-    addr->email[conn->db->max_data - 1] = '\0';
-    if(!res){
-        die("Email copy failed", conn);
+    client->in_len -= start - client->in;
+    memmove(client->in, start, client->in_len);
+
+    fclose(out);
+    if(reply_len > 0){
+        char *pending = Stats_realloc(client->out, client->out_len + reply_len);
+        if(!pending){
+            die("Memory error", conn);
+        }
+        client->out = pending;
+        memcpy(client->out + client->out_len, reply, reply_len);
+        client->out_len += reply_len;
     }
+    free(reply);
 }
 
-void Database_get(struct Connection *conn, int id)
+void Server_write(struct Client *client)
 {
-    struct Address *addr = &((struct Address *)conn->db->rows)[id];
+    // send as much of the pending reply as the socket takes right now
+    long rc = write(client->fd, client->out + client->out_sent, client->out_len - client->out_sent);
 
-    if(addr->set){
-        Address_print(addr);
-    } else {
-        die("ID is not set", conn);
+    if(rc < 0){
+        close(client->fd);
+        client->fd = -1;
+        client->in_len = 0;
+        client->out_len = 0;
+        client->out_sent = 0;
+        return;
+    }
+
+    client->out_sent += rc;
+    if(client->out_sent == client->out_len){
+        client->out_len = 0;
+        client->out_sent = 0;
     }
 }
 
-int Compare_terms(struct Connection *conn, char *search_term, char *record)
+void Database_serve(struct Connection *conn, const char *path)
+// one poll() loop over the listening socket and every client.  Each
+// round runs all the requests that came in, commits them together,
+// and only then lets the replies go out.
 {
-    // will return a match if the first 3 characters match
+    struct Client clients[SERVER_MAX_CLIENTS];
+    struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct sigaction sa = {.sa_handler = Server_signal};
     int i = 0;
-    int match = 1;
-    for(i = 0; i < 3; i++){
-        if(search_term[i] != record[i] && search_term[i] != '\0' && record[i] != '\0'){
-            match = 0;
-            break;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        die("Socket path is too long", conn);
+    }
+    strcpy(addr.sun_path, path);
+
+    // a socket left behind by a server that died can go, anything
+    // else at path is somebody's file
+    struct stat st;
+    if(lstat(path, &st) == 0){
+        if(!S_ISSOCK(st.st_mode)){
+            die("Socket path exists and is not a socket", conn);
         }
+        unlink(path);
+    } else if(errno != ENOENT){
+        die("Cannot check the socket path", conn);
     }
+    errno = 0;
 
-    return match;
-}
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener == -1){
+        die("Failed to create socket", conn);
+    }
+    if(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 16) == -1
+            || lstat(path, &st) == -1){
+        die("Failed to listen on socket", conn);
+    }
 
-void Database_find(struct Connection *conn, char *term)
-{
-    int i = 0;
-    int found = 0;
+    // no SA_RESTART, so a signal wakes poll() up
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-    for(i = 0; i < conn->db->max_rows; i++){
-        struct Address *addr = &((struct Address *)conn->db->rows)[i];
-        if(addr->set){
-            if(Compare_terms(conn, term, addr->name) || Compare_terms(conn, term, addr->email)){
-                Address_print(addr);
-                found = 1;
+    for(i = 0; i < SERVER_MAX_CLIENTS; i++){
+        struct Client empty = {.fd = -1};
+        clients[i] = empty;
+    }
+
+    while(!Server_stop){
+        // a client with a reply pending isn't read from until it's sent
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for(i = 0; i < SERVER_MAX_CLIENTS; i++){
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = clients[i].out_len ? POLLOUT : POLLIN;
+            fds[i + 1].revents = 0;
+        }
+
+        if(poll(fds, SERVER_MAX_CLIENTS + 1, -1) == -1){
+            if(errno == EINTR){
+                errno = 0;
+                continue;
+            }
+            die("Failed to poll", conn);
+        }
+
+        if(fds[0].revents & POLLIN){
+            int fd = accept(listener, NULL, NULL);
+            for(i = 0; fd != -1 && i < SERVER_MAX_CLIENTS; i++){
+                if(clients[i].fd == -1){
+                    clients[i].fd = fd;
+                    break;
+                }
+            }
+            if(fd != -1 && i == SERVER_MAX_CLIENTS){
+                close(fd);
+            }
+        }
+
+        for(i = 0; i < SERVER_MAX_CLIENTS; i++){
+            if(!clients[i].out_len && (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))){
+                Server_read(conn, &clients[i]);
+            }
+        }
+
+        // everyone's writes from this round share one flush
+        Wal_commit(conn);
+
+        for(i = 0; i < SERVER_MAX_CLIENTS; i++){
+            if(clients[i].fd != -1 && clients[i].out_len){
+                Server_write(&clients[i]);
             }
         }
     }
 
-    if(!found){
-        printf("Search term '%s' was not found\n", term);
+    for(i = 0; i < SERVER_MAX_CLIENTS; i++){
+        if(clients[i].fd != -1){
+            close(clients[i].fd);
+        }
+        free(clients[i].in);
+        free(clients[i].out);
     }
+    close(listener);
+    // only if it is still ours, not one another server has put there since
+    struct stat now;
+    if(lstat(path, &now) == 0 && S_ISSOCK(now.st_mode) && now.st_dev == st.st_dev && now.st_ino == st.st_ino){
+        unlink(path);
+    }
+
+    Database_checkpoint(conn);
 }
 
-void Database_delete(struct Connection *conn, int id)
+void Database_prefetch(struct Connection *conn, int argc, char *argv[])
 {
-    struct Address addr = {.id = id, .set = 0};
-    ((struct Address *)conn->db->rows)[id] = addr;
+    // read everything the action is going to look at, so that once
+    // the snapshot has been checked nothing more comes from the file
+    switch(argv[2][0]) {
+        case 'g':
+            if(argc >= 4 && atoi(argv[3]) >= 0 && atoi(argv[3]) < conn->db->max_rows){
+                Database_row(conn, atoi(argv[3]));
+            }
+            break;
+        case 'n':
+            Database_load_bits(conn);
+            break;
+        case 'e':
+            if(argc == 4 || argc == 5){
+                Hash_prefetch(conn, argc == 5 ? Hash_field(conn, argv[4]) : DB_HASH_EMAIL, argv[3]);
+            }
+            break;
+        default:
+            Database_load(conn);
+    }
 }
 
-void Database_list(struct Connection *conn)
+struct Connection *Database_snapshot(const char *filename, int argc, char *argv[])
+// readers take no lock.  They read what they need, then check the
+// header again: a checkpoint makes the generation odd while it
+// works and changes it again when it is done, and a rewrite
+// changes the old file's magic, so if the header is the same the
+// rows read are all from one state of the database.  If not, or a
+// read failed halfway because the file changed, start over, for as
+// long as it takes a live writer to finish.
 {
-    int i = 0;
-    struct Database *db = conn->db;
+    jmp_buf recover;
 
-    for(i = 0; i < conn->db->max_rows; i++){
-        struct Address *cur = &((struct Address *)db->rows)[i];
+    for(int try = 0; try < DB_SNAPSHOT_TRIES; try++){
+        struct Connection *conn = Database_open(filename, argv[2][0], 0, 0);
+        conn->recover = &recover;
+
+        if(setjmp(recover) == 0 && conn->db->generation % 2 == 0){
+            Database_prefetch(conn, argc, argv);
+            if(Database_unchanged(conn)){
+                conn->recover = NULL;
+                return conn;
+            }
+        } else if(Database_unchanged(conn) && conn->db->generation % 2 == 0){
+            // nothing changed, so the file really is broken
+            conn->recover = NULL;
+            die(conn->error, conn);
+        }
 
-        if(cur->set) {
-            Address_print(cur);
+        Database_close(conn);
+        usleep(DB_SNAPSHOT_WAIT);
+        if(try == DB_SNAPSHOT_TRIES - 1 && Wal_busy(filename)){
+            try = -1;
         }
     }
+
+    die("Database kept changing, try again (after a crash, the next write recovers it)", NULL);
+    return NULL;
 }
 
 int main(int argc, char *argv[])
 {
     struct Connection *conn = NULL;
+    FILE *script = NULL;
+
+    Stats_start();
 
     if(argc < 3){
         die("USAGE: ex17 <dbfile> <action> [action params]", conn);
@@ -357,85 +5113,107 @@ int main(int argc, char *argv[])
 
     char *filename = argv[1];
     char action = argv[2][0];
-    int id = 0;
-    char *term;
     int max_data = 0;
     int max_rows = 0;
 
-    if(action != 'c'){
+    if(strchr("glfnxte", action)){
+        conn = Database_snapshot(filename, argc, argv);
+    } else if(action != 'c'){
         conn = Database_open(filename, action, 0, 0);
-        Database_load(conn);
-        if(argc > 3 && action != 'r' && action != 'f'){
-            id = atoi(argv[3]);
-        }
-        if(id >= conn->db->max_rows && action != 'r' && action != 'f'){
-            die("There aren't that many records", conn);
-        }
+        Database_recover(conn);
     }
+    // a snapshot's loading is done, the rest is the action
+    Stats_phase(STATS_OP);
 
     switch(action) {
         case 'c':
-            if(argc == 5){
+            if(argc == 5 || argc == 6){
                 max_data = atoi(argv[3]);
                 max_rows = atoi(argv[4]);
+                if(max_data < 1 || max_rows < 1){
+                    die("max_data and max_rows must be at least 1", conn);
+                }
             } else {
-                die("c (create) usage: ex17 <dbfile> c <max_data> <max_rows>", conn);
+                die("c (create) usage: ex17 <dbfile> c <max_data> <max_rows> [compressed|raw]", conn);
             }
             conn = Database_open(filename, action, max_data, max_rows);
+            if(argc == 6){
+                conn->db->flags = Database_storage(conn, argv[5], 0);
+            }
             Database_create(conn);
-            Database_write(conn);
+            Database_checkpoint(conn);
             break;
-        case 'g':
-            if(argc != 4){
-                die("Need an id to get", conn);
+        case 'r':
+            // stream the rows into a new file with the new sizes, and
+            // compressed or not as asked, otherwise as it was
+            if(argc == 5 || argc == 6){
+                max_data = atoi(argv[3]);
+                max_rows = atoi(argv[4]);
+                if(max_data < 1 || max_rows < 1){
+                    die("max_data and max_rows must be at least 1", conn);
+                }
+                int flags = argc == 6 ? Database_storage(conn, argv[5], conn->db->flags) : conn->db->flags;
+                Database_rewrite(conn, max_data, max_rows, flags);
+            } else {
+                printf("Current size:\n\tmax_data: %d\n\tmax_rows: %d\n", conn->db->max_data, conn->db->max_rows);
+                die("r (resize) usage: ex17 <dbfile> r <max_data> <max_rows> [compressed|raw]", conn);
             }
-
-            Database_get(conn, id);
             break;
-        case 's':
-            if(argc != 6){
-                die("Need id, name and email to set", conn);
+        case 'b':
+            if(argc == 3){
+                script = stdin;
+            } else if(argc == 4){
+                script = fopen(argv[3], "r");
+                if(!script){
+                    die("Failed to open the batch script", conn);
+                }
+            } else {
+                die("b (batch) usage: ex17 <dbfile> b [script]", conn);
+            }
+            Database_batch(conn, script);
+            if(script != stdin){
+                fclose(script);
             }
-
-            Database_set(conn, id, argv[4], argv[5]);
-            Database_write(conn);
             break;
-        case 'd':
+        case 'u':
             if(argc != 4){
-                die("Need id to delete", conn);
+                die("u (serve) usage: ex17 <dbfile> u <socket>", conn);
             }
-
-            Database_delete(conn, id);
-            Database_write(conn);
+            Database_serve(conn, argv[3]);
             break;
-        case 'l':
-            Database_list(conn);
+        case 'i':
+            if(argc != 4){
+                die("i (import) usage: ex17 <dbfile> i <file>", conn);
+            }
+            // in the log and on disk before the checkpoint starts, so
+            // Database_recover can redo one that is cut short
+            Database_import(conn, argv[3]);
+            Wal_commit(conn);
+            if(conn->wal_size){
+                Database_checkpoint(conn);
+            }
             break;
-        case 'r':
-            // database is already loaded using old size parameters
-            // just change them in RAM then write back to the file
-            if(argc == 5){
-                conn->db->max_data = atoi(argv[3]);
-                conn->db->max_rows = atoi(argv[4]);
-            } else {
-                printf("Current size:\n\tmax_data: %d\n\tmax_rows: %d\n", conn->db->max_data, conn->db->max_rows);
-                die("r (resize) usage: ex17 <dbfile> r <max_data> <max_rows>", conn);
+        case 'h':
+            // rows in RAM have to match the file before they are indexed
+            if(argc > 4){
+                die("h (hash) usage: ex17 <dbfile> h [email|name|both|none]", conn);
             }
-            Database_write(conn);
+            Database_checkpoint(conn);
+            Hash_build(conn, argc == 4 ? Hash_field(conn, argv[3]) : DB_HASH_EMAIL);
             break;
-        case 'f':
-            if(argc != 4){
-                die("Need a search term to look up", conn);
+        case 'x':
+            if(argc > 4){
+                die("x (export) usage: ex17 <dbfile> x [file]", conn);
             }
-            term = argv[3];
-            Database_find(conn, term);
+            Database_export(conn, argc == 4 ? argv[3] : NULL);
             break;
         default:
-            die("Invalid action, only: c=create, g=get, s=set, d=del, l=list", conn);
+            Database_execute(conn, argc, argv);
+            Wal_commit(conn);
     }
 
+    Stats_phase(STATS_CLOSE);
     Database_close(conn);
 
     return 0;
 }
-
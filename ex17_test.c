@@ -0,0 +1,401 @@
+/*
+Checks of ex17_mod.c's actions that don't need a crash (ex17_crash.c
+has those).
+
+A find's first scan packs names and emails SCAN_TILE at a time and
+matches them with an AVX2 or SSE2 kernel where the CPU has one.  This
+fills a database with strings from a small alphabet, so that many
+share a prefix, some of them either side of SCAN_WIDTH (16) bytes long
+and some with bytes above 127, then looks up prefixes of them of every
+length, and ones that just miss, through the program and through a
+build with EX17_SCAN_SCALAR, which only has the byte loop.  Both have
+to print exactly the rows whose name or email starts with the term,
+in id order.
+
+c has to turn down a max_data or max_rows below 1 before it touches
+the file: a database created with max_data 0 crashed on its first s.
+Over a database that is there, the database has to be left as it was.
+A c that fails before its new file is renamed in has to keep the old
+file's log too, and one that gets there must not replay it.
+
+Usage: ex17_test [program [scalar program]]
+
+They default to bin/ex17_mod and bin/ex17_mod_scalar, which 'make test'
+builds.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_ROWS 600
+#define TEST_MAX_DATA 64
+#define TEST_KEYS 40        // names and emails whose prefixes are looked up
+
+struct Test {
+    const char *prog;
+    const char *scalar;
+    char dir[64];
+    char db[96];
+    char out[96];
+    char csv[96];
+    char path[128];     // scratch for <db>.wal names
+    char names[TEST_ROWS][TEST_MAX_DATA];
+    char emails[TEST_ROWS][TEST_MAX_DATA];
+    int set[TEST_ROWS];
+    int failures;
+};
+
+void die(const char *message)
+{
+    if(errno){
+        perror(message);
+    } else {
+        printf("ERROR: %s\n", message);
+    }
+
+    exit(1);
+}
+
+int Test_run(struct Test *t, const char *prog, char *args[])
+// run prog with args, stdout into t->out, and hand back its exit status
+{
+    int status = 0;
+
+    pid_t pid = fork();
+    if(pid == -1){
+        die("Failed to fork");
+    }
+    if(pid == 0){
+        int out = open(t->out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out == -1){
+            _exit(127);
+        }
+        dup2(out, STDOUT_FILENO);
+        execv(prog, args);
+        perror(prog);
+        _exit(127);
+    }
+
+    if(waitpid(pid, &status, 0) == -1){
+        die("Failed to wait for the child");
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+char *Test_slurp(const char *path, long *size)
+{
+    // the whole file, NUL ended
+    FILE *file = fopen(path, "r");
+    if(!file){
+        die("Failed to open a file to read");
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char *data = malloc(*size + 1);
+    if(!data || (long)fread(data, 1, *size, file) != *size){
+        die("Failed to read a file");
+    }
+    data[*size] = '\0';
+    fclose(file);
+
+    return data;
+}
+
+void Test_string(char *s)
+{
+    // 0 to 40 bytes, bunched around the 16 a scan compares at once
+    const int lens[] = { 0, 1, 2, 3, 5, 8, 15, 16, 17, 20, 31, 32, 33, 40 };
+    const char alphabet[] = { 'a', 'b', (char)0xe9 };
+    int len = lens[rand() % (sizeof(lens) / sizeof(lens[0]))];
+    int i = 0;
+
+    for(i = 0; i < len; i++){
+        s[i] = alphabet[rand() % sizeof(alphabet)];
+    }
+    s[i] = '\0';
+}
+
+void Test_fill(struct Test *t)
+// create the database and set four rows in five, some runs of set rows
+// shorter than a tile and some longer
+{
+    char data[16];
+    char rows[16];
+    int i = 0;
+
+    FILE *csv = fopen(t->csv, "w");
+    if(!csv){
+        die("Failed to open the import file");
+    }
+    for(i = 0; i < TEST_ROWS; i++){
+        t->set[i] = rand() % 5 != 0;
+        if(t->set[i]){
+            Test_string(t->names[i]);
+            Test_string(t->emails[i]);
+            fprintf(csv, "%d,%s,%s\n", i, t->names[i], t->emails[i]);
+        }
+    }
+    if(fclose(csv) != 0){
+        die("Failed to write the import file");
+    }
+
+    snprintf(data, sizeof(data), "%d", TEST_MAX_DATA);
+    snprintf(rows, sizeof(rows), "%d", TEST_ROWS);
+    char *create[] = { (char *)t->prog, t->db, "c", data, rows, NULL };
+    char *import[] = { (char *)t->prog, t->db, "i", t->csv, NULL };
+    if(Test_run(t, t->prog, create) != 0 || Test_run(t, t->prog, import) != 0){
+        die("Failed to set up the database");
+    }
+}
+
+char *Test_expect(struct Test *t, const char *term, long *size)
+{
+    // what f term has to print: "id name email" for every match
+    long len = strlen(term);
+    long cap = 256;
+    char *want = malloc(cap);
+    int i = 0;
+
+    *size = 0;
+    for(i = 0; i < TEST_ROWS; i++){
+        if(!t->set[i] || (strncmp(t->names[i], term, len) != 0 && strncmp(t->emails[i], term, len) != 0)){
+            continue;
+        }
+        while(want && cap - *size < 2 * TEST_MAX_DATA + 16){
+            cap *= 2;
+            want = realloc(want, cap);
+        }
+        if(!want){
+            die("Memory error");
+        }
+        *size += sprintf(want + *size, "%d %s %s\n", i, t->names[i], t->emails[i]);
+    }
+    if(*size == 0){
+        want = realloc(want, len + 64);
+        if(!want){
+            die("Memory error");
+        }
+        *size = sprintf(want, "Search term '%s' was not found\n", term);
+    }
+
+    return want;
+}
+
+void Test_find(struct Test *t, const char *term)
+{
+    const char *progs[] = { t->prog, t->scalar };
+    long want_size = 0;
+    long size = 0;
+    int i = 0;
+
+    char *want = Test_expect(t, term, &want_size);
+    for(i = 0; i < 2; i++){
+        char *args[] = { (char *)progs[i], t->db, "f", (char *)term, NULL };
+        char *found = NULL;
+
+        if(Test_run(t, progs[i], args) == 0){
+            found = Test_slurp(t->out, &size);
+        }
+        if(!found || size != want_size || memcmp(found, want, size) != 0){
+            printf("FAIL: %s found the wrong rows for '%s'\n", progs[i], term);
+            t->failures++;
+        }
+        free(found);
+    }
+    free(want);
+}
+
+void Test_create(struct Test *t)
+{
+    // sizes c has to turn down, over a new file and over t->db
+    const char *sizes[][2] = { {"0", "10"}, {"10", "0"}, {"-5", "10"}, {"10", "-5"} };
+    char fresh[128];
+    long want_size = 0;
+    long size = 0;
+    int i = 0;
+
+    snprintf(fresh, sizeof(fresh), "%s/fresh.db", t->dir);
+    char *list[] = { (char *)t->prog, t->db, "l", NULL };
+    if(Test_run(t, t->prog, list) != 0){
+        die("Failed to list the database");
+    }
+    char *want = Test_slurp(t->out, &want_size);
+
+    for(i = 0; i < 4; i++){
+        char *args[] = { (char *)t->prog, fresh, "c", (char *)sizes[i][0], (char *)sizes[i][1], NULL };
+        if(Test_run(t, t->prog, args) == 0 || access(fresh, F_OK) == 0){
+            printf("FAIL: c %s %s made a database\n", sizes[i][0], sizes[i][1]);
+            t->failures++;
+            unlink(fresh);
+        }
+
+        args[1] = t->db;
+        char *found = NULL;
+        if(Test_run(t, t->prog, args) != 0 && Test_run(t, t->prog, list) == 0){
+            found = Test_slurp(t->out, &size);
+        }
+        if(!found || size != want_size || memcmp(found, want, size) != 0){
+            printf("FAIL: c %s %s over a database changed it\n", sizes[i][0], sizes[i][1]);
+            t->failures++;
+        }
+        free(found);
+    }
+    free(want);
+
+    snprintf(t->path, sizeof(t->path), "%s.wal", fresh);
+    unlink(t->path);
+    printf("create: %d bad sizes\n", i);
+}
+
+char *Test_list(struct Test *t, long *size)
+{
+    char *args[] = { (char *)t->prog, t->db, "l", NULL };
+
+    if(Test_run(t, t->prog, args) != 0){
+        die("Failed to list the database");
+    }
+
+    return Test_slurp(t->out, size);
+}
+
+void Test_recreate(struct Test *t)
+// c over t->db with rows still in its log, first failing before the
+// rename (a directory where it builds the new file), then for real
+{
+    char data[16];
+    char rows[16];
+    char id[16];
+    char resize[128];
+    long want_size = 0;
+    long size = 0;
+    struct stat st;
+    int added = 0;
+    int i = 0;
+
+    for(i = 0; i < TEST_ROWS && added < 3; i++){
+        if(!t->set[i]){
+            snprintf(id, sizeof(id), "%d", i);
+            char *set[] = { (char *)t->prog, t->db, "s", id, "logged", "logged@example.com", NULL };
+            if(Test_run(t, t->prog, set) != 0){
+                die("Failed to set a row");
+            }
+            added++;
+        }
+    }
+    snprintf(t->path, sizeof(t->path), "%s.wal", t->db);
+    if(stat(t->path, &st) == -1 || st.st_size == 0){
+        die("The sets didn't stay in the log");
+    }
+    char *want = Test_list(t, &want_size);
+
+    snprintf(data, sizeof(data), "%d", TEST_MAX_DATA);
+    snprintf(rows, sizeof(rows), "%d", TEST_ROWS);
+    char *create[] = { (char *)t->prog, t->db, "c", data, rows, NULL };
+    snprintf(resize, sizeof(resize), "%s.resize", t->db);
+    if(mkdir(resize, 0755) == -1){
+        die("Failed to make a directory");
+    }
+    int status = Test_run(t, t->prog, create);
+    rmdir(resize);
+    char *found = Test_list(t, &size);
+    if(status == 0 || size != want_size || memcmp(found, want, size) != 0){
+        printf("FAIL: a c that failed lost what the log held\n");
+        t->failures++;
+    }
+    free(found);
+    free(want);
+
+    found = NULL;
+    if(Test_run(t, t->prog, create) == 0){
+        found = Test_list(t, &size);
+    }
+    if(!found || size != 0){
+        printf("FAIL: a new database came out with rows in it\n");
+        t->failures++;
+    }
+    free(found);
+
+    printf("recreate: %d rows in the log\n", added);
+}
+
+void Test_scan(struct Test *t)
+{
+    char term[TEST_MAX_DATA + 1];
+    int finds = 0;
+    int i = 0;
+
+    Test_find(t, "");
+    for(i = 0; i < TEST_KEYS; i++){
+        int row = rand() % TEST_ROWS;
+        const char *key = i % 2 ? t->emails[row] : t->names[row];
+        int len = strlen(key);
+
+        if(!t->set[row] || len == 0){
+            continue;
+        }
+        // every prefix, then the whole key with one more byte
+        for(int n = 1; n <= len + 1; n++){
+            memcpy(term, key, len);
+            term[len] = 'a';
+            term[n] = '\0';
+            Test_find(t, term);
+            finds++;
+        }
+    }
+
+    printf("scan: %d finds\n", finds + 1);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct Test t = { .prog = "bin/ex17_mod", .scalar = "bin/ex17_mod_scalar" };
+    const char *tmp = getenv("TMPDIR");
+
+    if(argc > 1){
+        t.prog = argv[1];
+    }
+    if(argc > 2){
+        t.scalar = argv[2];
+    }
+    if(argc > 3){
+        die("USAGE: ex17_test [program [scalar program]]");
+    }
+
+    snprintf(t.dir, sizeof(t.dir), "%s/ex17_test.XXXXXX", tmp ? tmp : "/tmp");
+    if(!mkdtemp(t.dir)){
+        die("Failed to make a scratch directory");
+    }
+    snprintf(t.db, sizeof(t.db), "%s/test.db", t.dir);
+    snprintf(t.out, sizeof(t.out), "%s/out", t.dir);
+    snprintf(t.csv, sizeof(t.csv), "%s/rows.csv", t.dir);
+
+    srand(17);
+    Test_fill(&t);
+    Test_scan(&t);
+    Test_create(&t);
+    Test_recreate(&t);
+
+    unlink(t.db);
+    snprintf(t.path, sizeof(t.path), "%s.wal", t.db);
+    unlink(t.path);
+    unlink(t.out);
+    unlink(t.csv);
+    rmdir(t.dir);
+
+    if(t.failures){
+        printf("%d failures\n", t.failures);
+        return 1;
+    }
+    printf("OK\n");
+
+    return 0;
+}